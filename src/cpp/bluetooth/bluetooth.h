@@ -4,17 +4,87 @@
 #include <functional>
 #include <unordered_map>
 #include <memory>
+#include <cstdint>
+#include <chrono>
+
+// Logical channels sharing one connection; lower values are sent first
+enum class BluetoothChannel : uint8_t {
+    CONTROL = 0,
+    MESSAGING = 1,
+    FILE_TRANSFER = 2,
+};
+
+// NATIVE drives the radio; LOOPBACK connects instances on one machine over
+// Unix-domain sockets instead, for benchmarks and profiling without hardware
+enum class BluetoothBackend {
+    NATIVE,
+    LOOPBACK,
+};
+
+// Link shaping for loopback connections, to benchmark against radio-like
+// conditions. Zero fields leave that aspect unshaped.
+struct LinkProfile {
+    uint64_t bandwidth_bps = 0;    // Egress bits per second
+    uint32_t latency_ms = 0;       // One-way, applied to received messages
+    uint32_t jitter_ms = 0;        // Uniform +/- around the latency
+    double loss = 0;               // Message loss outside bursts
+    double burst_enter = 0;        // Per-message chance a loss burst starts
+    double burst_exit = 0;         // Per-message chance it ends
+    double burst_loss = 0;         // Message loss during a burst
+    uint32_t disconnect_after_ms = 0; // Drops the link this long after the profile is set
+    uint32_t seed = 1;             // Loss and jitter are reproducible per seed
+
+    static LinkProfile rfcomm(); // ~2 Mbit/s, 20-80 ms RTT, occasional loss bursts
+    // "rfcomm,latency=40,loss=0.01,..." with the field names above (bandwidth,
+    // latency, jitter, loss, burst_enter, burst_exit, burst_loss, disconnect_after, seed)
+    static bool parse(const std::string& spec, LinkProfile& profile);
+};
+
+// Counters for one connection since it opened. Frames are wire frames, so a
+// large message counts once per fragment.
+struct LinkStats {
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t frames_sent = 0;
+    uint64_t frames_received = 0;
+    uint64_t write_calls = 0;    // Write syscalls, including ones that would have blocked
+    uint64_t read_calls = 0;
+    uint64_t partial_writes = 0; // Writes the link took only part of
+    uint64_t queued_bytes = 0;   // Outbound queue depth right now
+    uint32_t srtt_us = 0;        // Smoothed RTT, 0 until the first sample
+    uint32_t rttvar_us = 0;
+    uint64_t rtt_samples = 0;
+};
 
 class Bluetooth {
 public:
+    // Picks LOOPBACK when BLUEBEAM_BT_BACKEND=loopback, named by BLUEBEAM_BT_LOOPBACK_ID
     Bluetooth();
+    // A loopback instance with a local_id listens for others under that name
+    explicit Bluetooth(BluetoothBackend backend, const std::string& local_id = "");
     ~Bluetooth();
 
     void scan();
+    // Connects two loopback instances directly over a socketpair; each sees the other under the given id
+    static bool connect_loopback_pair(Bluetooth& a, const std::string& a_id, Bluetooth& b, const std::string& b_id);
     bool connect(const std::string& device_id);
-    bool send_data(const std::string& device_id, const std::vector<uint8_t>& data);
+    bool is_connected(const std::string& device_id);
+    bool send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel = BluetoothChannel::MESSAGING);
     void set_receive_callback(std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback);
+    // Messages on a channel without its own callback go to the receive callback
+    void set_channel_receive_callback(BluetoothChannel channel, std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback);
     void set_disconnect_callback(std::function<void(const std::string& device_id)> callback);
+    // Backpressure: a link stops being writable once its outbound queue passes a
+    // high watermark, and the ready callback fires when it has drained well below it
+    bool is_writable(const std::string& device_id);
+    void set_ready_callback(std::function<void(const std::string& device_id)> callback);
+    // Shapes a loopback connection; may be changed at any time to script a run.
+    // New loopback connections start from BLUEBEAM_BT_LINK_PROFILE when set.
+    bool set_link_profile(const std::string& device_id, const LinkProfile& profile);
+    // False if there is no connection to device_id
+    bool get_link_stats(const std::string& device_id, LinkStats& stats);
+    // The link can't see round trips itself; messaging reports its ACK times here
+    void record_rtt_sample(const std::string& device_id, std::chrono::microseconds rtt);
     void call_disconnect_callback(const std::string& device_id);
     std::vector<std::string> get_discovered_devices();
     std::string get_device_id_from_name(const std::string& name);
@@ -1,5 +1,11 @@
 #include "bluetooth.h"
+#include "frame_codec.h"
+#include "channel_mux.h"
+#include "link_stats.h"
 #include <unordered_map>
+#include <array>
+#include <mutex>
+#include <algorithm>
 #include <CoreBluetooth/CoreBluetooth.h>
 
 @interface BluetoothDelegate : NSObject<CBCentralManagerDelegate, CBPeripheralDelegate>
@@ -71,11 +77,36 @@ public:
     CBCentralManager* centralManager;
     BluetoothDelegate* delegate;
     std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> receive_callback;
+    std::array<std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)>, ChannelMux::CHANNEL_COUNT> channel_callbacks;
     std::function<void(const std::string& device_id)> disconnect_callback;
+    std::function<void(const std::string& device_id)> ready_callback;
     std::unordered_map<std::string, CBPeripheral*> connections;
     std::unordered_map<std::string, CBPeripheral*> discovered_devices;
     std::unordered_map<std::string, std::string> name_to_id;
     std::unordered_map<std::string, CBCharacteristic*> tx_characteristics;
+    static constexpr size_t MAX_SLICES = 64;
+
+    struct Link {
+        ChannelMux mux;
+        std::mutex write_mutex; // One sender drains the queue at a time
+        FrameDecoder decoder;   // Delegate queue only
+        LinkCounters counters;
+    };
+    std::unordered_map<std::string, Link> links; // Guarded by links_mutex; entries are never erased
+    std::mutex links_mutex;
+
+    // Senders and the delegate queue both reach links, so lookups go through the lock.
+    // The Link itself stays put once created, so it is used after the lock is dropped.
+    Link& link_for(const std::string& device_id) {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        return links[device_id];
+    }
+
+    Link* find_link(const std::string& device_id) {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        auto it = links.find(device_id);
+        return it != links.end() ? &it->second : nullptr;
+    }
 
     Impl() {
         delegate = [[BluetoothDelegate alloc] init];
@@ -93,6 +124,13 @@ Bluetooth::Bluetooth() : pimpl(std::make_unique<Impl>()) {
     pimpl->delegate.bluetooth = this;
 }
 
+// The loopback backend is Linux-only for now; other backends always use the radio
+Bluetooth::Bluetooth(BluetoothBackend, const std::string&) : Bluetooth() {}
+
+bool Bluetooth::connect_loopback_pair(Bluetooth&, const std::string&, Bluetooth&, const std::string&) {
+    return false;
+}
+
 Bluetooth::~Bluetooth() = default;
 
 void Bluetooth::scan() {
@@ -116,25 +154,92 @@ bool Bluetooth::connect(const std::string& device_id) {
     return false;
 }
 
-bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data) {
+bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel) {
     auto it = pimpl->tx_characteristics.find(device_id);
     if (it != pimpl->tx_characteristics.end()) {
         CBCharacteristic* characteristic = it->second;
         auto conn_it = pimpl->connections.find(device_id);
         if (conn_it != pimpl->connections.end()) {
             CBPeripheral* peripheral = conn_it->second;
-            NSData* nsdata = [NSData dataWithBytes:data.data() length:data.size()];
-            [peripheral writeValue:nsdata forCharacteristic:characteristic type:CBCharacteristicWriteWithResponse];
+            size_t max_write = [peripheral maximumWriteValueLengthForType:CBCharacteristicWriteWithResponse];
+            if (max_write == 0) return false;
+            Impl::Link& link = pimpl->link_for(device_id);
+            bool was_idle = false;
+            if (!link.mux.enqueue(channel, data, was_idle)) return false;
+
+            // CoreBluetooth queues writes itself, so the sender hands over everything
+            // staged, cut to the ATT MTU; the receiver's decoder rejoins the pieces
+            bool ready = false;
+            ChannelMux::Slice slices[Impl::MAX_SLICES];
+            std::vector<uint8_t> batch;
+            {
+                std::lock_guard<std::mutex> lock(link.write_mutex);
+                while (size_t count = link.mux.gather(slices, Impl::MAX_SLICES)) {
+                    batch.clear();
+                    for (size_t i = 0; i < count; ++i) {
+                        batch.insert(batch.end(), slices[i].data, slices[i].data + slices[i].length);
+                    }
+                    for (size_t offset = 0; offset < batch.size(); offset += max_write) {
+                        size_t length = std::min(max_write, batch.size() - offset);
+                        NSData* nsdata = [NSData dataWithBytes:batch.data() + offset length:length];
+                        [peripheral writeValue:nsdata forCharacteristic:characteristic type:CBCharacteristicWriteWithResponse];
+                        LinkCounters::add(link.counters.write_calls);
+                    }
+                    LinkCounters::add(link.counters.bytes_sent, batch.size());
+                    ready |= link.mux.consume(batch.size());
+                }
+            }
+            if (ready && pimpl->ready_callback) {
+                pimpl->ready_callback(device_id);
+            }
             return true;
         }
     }
     return false;
 }
 
+bool Bluetooth::is_connected(const std::string& device_id) {
+    return pimpl->connections.count(device_id) > 0;
+}
+
+bool Bluetooth::is_writable(const std::string& device_id) {
+    Impl::Link* link = pimpl->find_link(device_id);
+    return pimpl->connections.count(device_id) && (!link || link->mux.writable());
+}
+
+// Only loopback links can be shaped, and CoreBluetooth links never are
+bool Bluetooth::set_link_profile(const std::string&, const LinkProfile&) {
+    return false;
+}
+
+// Writes are handed whole to CoreBluetooth, so there are no partial writes to count
+bool Bluetooth::get_link_stats(const std::string& device_id, LinkStats& stats) {
+    Impl::Link* link = pimpl->find_link(device_id);
+    if (!pimpl->connections.count(device_id) || !link) return false;
+    stats = LinkStats();
+    link->counters.read(stats);
+    link->mux.read_stats(stats);
+    return true;
+}
+
+void Bluetooth::record_rtt_sample(const std::string& device_id, std::chrono::microseconds rtt) {
+    if (Impl::Link* link = pimpl->find_link(device_id)) {
+        link->counters.add_rtt_sample(rtt);
+    }
+}
+
+void Bluetooth::set_ready_callback(std::function<void(const std::string& device_id)> callback) {
+    pimpl->ready_callback = callback;
+}
+
 void Bluetooth::set_receive_callback(std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
     pimpl->receive_callback = callback;
 }
 
+void Bluetooth::set_channel_receive_callback(BluetoothChannel channel, std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
+    pimpl->channel_callbacks[static_cast<size_t>(channel)] = callback;
+}
+
 void Bluetooth::set_disconnect_callback(std::function<void(const std::string& device_id)> callback) {
     pimpl->disconnect_callback = callback;
 }
@@ -162,8 +267,25 @@ std::string Bluetooth::get_device_id_from_name(const std::string& name) {
 }
 
 void Bluetooth::receive_data(const std::string& device_id, const std::vector<uint8_t>& data) {
-    if (pimpl->receive_callback) {
-        pimpl->receive_callback(device_id, data);
+    Impl::Link& link = pimpl->link_for(device_id);
+    LinkCounters::add(link.counters.read_calls);
+    LinkCounters::add(link.counters.bytes_received, data.size());
+    bool malformed = false;
+    bool ok = link.decoder.feed(data.data(), data.size(), [&](const std::vector<uint8_t>& frame) {
+        LinkCounters::add(link.counters.frames_received);
+        malformed |= !link.mux.receive(frame, [&](BluetoothChannel channel, const std::vector<uint8_t>& message) {
+            auto& callback = pimpl->channel_callbacks[static_cast<size_t>(channel)];
+            if (callback) {
+                callback(device_id, message);
+            } else if (pimpl->receive_callback) {
+                pimpl->receive_callback(device_id, message);
+            }
+        });
+    });
+    if (!ok || malformed) {
+        // Out of sync; start over at the next write. The mux stays, since a sender may be using it
+        link.decoder = FrameDecoder();
+        link.mux.reset_receive();
     }
 }
 
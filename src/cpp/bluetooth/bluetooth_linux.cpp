@@ -1,70 +1,521 @@
 #include "bluetooth.h"
+#include "frame_codec.h"
+#include "channel_mux.h"
+#include "link_emulator.h"
+#include "connection_registry.h"
+#include "link_stats.h"
 #include <dbus/dbus.h>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <cstdlib>
+#include <cstring>
 #include <unordered_map>
+#include <memory>
+#include <array>
+#include <algorithm>
+#include <chrono>
 
 class Bluetooth::Impl {
 public:
+    static constexpr size_t READ_BUFFER_SIZE = 64 * 1024; // A full file chunk per read
+    static constexpr int MAX_EVENTS = 16;
+    static constexpr size_t MAX_IOV = 64; // Slices coalesced into one sendmsg
+    static constexpr const char* LOOPBACK_DIR = "/tmp/bluebeam-loopback";
+    static constexpr const char* LOOPBACK_SUFFIX = ".sock";
+    static constexpr int HELLO_TIMEOUT_MS = 1000; // Longest an accepted loopback peer has to name itself
+
+    BluetoothBackend backend;
+    std::string local_id;     // Loopback name other instances connect to
+    std::string loopback_dir;
+    LinkProfile default_profile; // From BLUEBEAM_BT_LINK_PROFILE
+    int listen_fd = -1;
     DBusConnection* conn;
     std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> receive_callback;
-    std::unordered_map<std::string, int> connections;
+    std::array<std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)>, ChannelMux::CHANNEL_COUNT> channel_callbacks;
+    std::function<void(const std::string& device_id)> disconnect_callback;
+    std::function<void(const std::string& device_id)> ready_callback;
+
+    // One socket and its state. Refcounted: the fd is closed only when the last
+    // holder lets go, so a send racing a disconnect can't hit a reused fd.
+    struct Connection {
+        Connection(const std::string& device_id, int fd) : device_id(device_id), fd(fd) {}
+        ~Connection() { close(fd); }
+
+        const std::string device_id;
+        const int fd;
+        ChannelMux mux;       // Outbound queue, drained by the reactor
+        FrameDecoder decoder; // Reactor thread only
+        std::unique_ptr<LinkEmulator> emulator; // Loopback links only
+        LinkCounters counters;
+    };
+    std::mutex connections_mutex; // Serializes connects and disconnects across both registries
+    ConnectionRegistry<std::string, Connection> connections; // Send path, by device id
+    ConnectionRegistry<int, Connection> connection_fds;      // Reactor events, by fd
+    std::vector<uint8_t> read_buffer = std::vector<uint8_t>(READ_BUFFER_SIZE);
     std::unordered_map<std::string, std::string> discovered_devices;
     std::thread receive_thread;
     std::atomic<bool> running{true};
+    int epoll_fd = -1;
+    int wake_fd = -1; // eventfd used to stop the reactor or hand it sockets to flush
+    std::mutex flush_mutex;
+    std::vector<std::shared_ptr<Connection>> flush_requests; // Connections whose idle queue just got data
+
+    // Accepted loopback sockets still sending their hello. Reactor thread only.
+    struct PendingHello {
+        std::string buffer; // Length byte, then as much of the id as has arrived
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::unordered_map<int, PendingHello> pending_hellos;
 
-    Impl() : conn(nullptr) {
-        DBusError error;
-        dbus_error_init(&error);
-        conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
-        if (dbus_error_is_set(&error)) {
-            dbus_error_free(&error);
-        } else {
+    Impl(BluetoothBackend backend, const std::string& local_id) : backend(backend), local_id(local_id), conn(nullptr) {
+        if (backend == BluetoothBackend::NATIVE) {
+            DBusError error;
+            dbus_error_init(&error);
+            conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+            if (dbus_error_is_set(&error)) {
+                dbus_error_free(&error);
+            }
+        }
+
+        // RFCOMM sockets don't need D-Bus, so the reactor runs either way
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd >= 0 && wake_fd >= 0) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = wake_fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+            if (backend == BluetoothBackend::LOOPBACK) {
+                const char* dir = std::getenv("BLUEBEAM_BT_LOOPBACK_DIR");
+                loopback_dir = dir && *dir ? dir : LOOPBACK_DIR;
+                const char* spec = std::getenv("BLUEBEAM_BT_LINK_PROFILE");
+                if (spec && !LinkProfile::parse(spec, default_profile)) default_profile = LinkProfile();
+                if (!this->local_id.empty()) listen_loopback();
+            }
             receive_thread = std::thread(&Impl::receive_worker, this);
         }
     }
 
     ~Impl() {
         running = false;
+        wake();
         if (receive_thread.joinable()) receive_thread.join();
-        for (auto& conn : connections) {
-            close(conn.second);
+        for (const auto& [sock, hello] : pending_hellos) close(sock);
+        flush_requests.clear();
+        connections.clear();
+        connection_fds.clear();
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            unlink(loopback_path(local_id).c_str());
         }
+        if (wake_fd >= 0) close(wake_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
         if (conn) dbus_connection_unref(conn);
     }
 
+    std::string loopback_path(const std::string& device_id) const {
+        return loopback_dir + "/" + device_id + LOOPBACK_SUFFIX;
+    }
+
+    static bool loopback_address(const std::string& path, struct sockaddr_un& addr) {
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    // Loopback peers find each other as <id>.sock in a shared directory
+    void listen_loopback() {
+        struct sockaddr_un addr;
+        std::string path = loopback_path(local_id);
+        if (!loopback_address(path, addr)) return;
+        mkdir(loopback_dir.c_str(), 0700);
+        unlink(path.c_str()); // Left behind by an instance that didn't shut down cleanly
+
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0) return;
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0) {
+            close(sock);
+            return;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = sock;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            close(sock);
+            return;
+        }
+        listen_fd = sock;
+    }
+
+    // A loopback connection opens with one byte of length and the connecting
+    // instance's id, which the accepting side uses as the device id
+    static bool send_hello(int sock, const std::string& id) {
+        if (id.empty() || id.size() > 255) return false;
+        std::string hello(1, static_cast<char>(id.size()));
+        hello += id;
+        return send(sock, hello.data(), hello.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(hello.size());
+    }
+
+    // Accepted sockets are parked until their hello arrives; the reactor reads it
+    // alongside every other socket, so a slow peer holds up nobody else
+    void accept_loopback() {
+        while (true) {
+            int sock = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (sock < 0) {
+                if (errno == EINTR) continue;
+                return; // EAGAIN: backlog drained
+            }
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = sock;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+                close(sock);
+                continue;
+            }
+            pending_hellos[sock] = {std::string(), std::chrono::steady_clock::now() + std::chrono::milliseconds(HELLO_TIMEOUT_MS)};
+        }
+    }
+
+    // Reads no further than the end of the hello, so whatever follows it is left
+    // in the socket for the connection's decoder
+    void read_hello(int sock) {
+        auto it = pending_hellos.find(sock);
+        if (it == pending_hellos.end()) return;
+        std::string& buffer = it->second.buffer;
+        auto hello_size = [&buffer] { return buffer.empty() ? size_t(1) : size_t(1) + static_cast<uint8_t>(buffer[0]); };
+        char chunk[256];
+        while (buffer.size() < hello_size()) {
+            ssize_t bytes_read = read(sock, chunk, hello_size() - buffer.size());
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return; // The rest comes with the next edge
+            if (bytes_read <= 0 || (buffer.empty() && chunk[0] == 0)) {
+                drop_hello(sock);
+                return;
+            }
+            buffer.append(chunk, bytes_read);
+        }
+        std::string device_id = buffer.substr(1);
+        pending_hellos.erase(it);
+        add_connection(device_id, sock, true);
+    }
+
+    void drop_hello(int sock) {
+        pending_hellos.erase(sock);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+        close(sock);
+    }
+
+    // Drops accepted sockets that haven't named themselves in time. Returns the
+    // epoll_wait timeout until the next deadline, -1 if none.
+    int expire_hellos() {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (auto it = pending_hellos.begin(); it != pending_hellos.end(); ) {
+            if (it->second.deadline <= now) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+                close(it->first);
+                it = pending_hellos.erase(it);
+                continue;
+            }
+            next = std::min(next, it->second.deadline);
+            ++it;
+        }
+        if (next == std::chrono::steady_clock::time_point::max()) return -1;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+        return static_cast<int>(wait + 1); // Round up so the deadline has passed on wakeup
+    }
+
+    void wake() {
+        if (wake_fd >= 0) {
+            uint64_t one = 1;
+            (void)write(wake_fd, &one, sizeof(one));
+        }
+    }
+
+    // Takes ownership of sock, closing it on failure. A device id that is already
+    // connected is refused rather than replaced, so a peer can't take over
+    // another's link. registered: sock is already in the epoll set (accepted, hello read)
+    bool add_connection(const std::string& device_id, int sock, bool registered = false) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        if (connections.find(device_id)) {
+            if (registered) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+            close(sock);
+            return false;
+        }
+
+        auto connection = std::make_shared<Connection>(device_id, sock); // Owns sock from here
+        if (backend == BluetoothBackend::LOOPBACK) {
+            // Seeded per peer so each link of a run sees its own, repeatable loss pattern
+            uint32_t seed = default_profile.seed ^ static_cast<uint32_t>(std::hash<std::string>{}(device_id));
+            connection->emulator = std::make_unique<LinkEmulator>(default_profile, seed);
+        }
+
+        // Registered before epoll sees the socket: the first edge may fire before
+        // epoll_ctl returns, and the reactor must find the connection for it.
+        // Re-arming an accepted socket also reports data that came right behind the hello.
+        connection_fds.insert(sock, connection);
+        connections.insert(device_id, connection);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = sock;
+        if (epoll_ctl(epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, sock, &ev) < 0) {
+            connections.remove(device_id, connection.get());
+            connection_fds.remove(sock, connection.get());
+            if (registered) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+            return false; // The last reference closes sock
+        }
+        return true;
+    }
+
+    void remove_connection(const std::shared_ptr<Connection>& connection) {
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            if (!connection_fds.remove(connection->fd, connection.get())) return; // Already gone
+            connections.remove(connection->device_id, connection.get());
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+            shutdown(connection->fd, SHUT_RDWR); // Fails anything still in flight; close waits for the last reference
+        }
+        if (disconnect_callback) {
+            disconnect_callback(connection->device_id);
+        }
+    }
+
+    void dispatch(const std::string& device_id, BluetoothChannel channel, const std::vector<uint8_t>& message) {
+        auto& callback = channel_callbacks[static_cast<size_t>(channel)];
+        if (callback) {
+            callback(device_id, message);
+        } else if (receive_callback) {
+            receive_callback(device_id, message);
+        }
+    }
+
+    // Edge-triggered: drain the socket until it would block, handing complete
+    // frames to the receive callback
+    void read_connection(const std::shared_ptr<Connection>& link) {
+        const std::string& device_id = link->device_id;
+        int fd = link->fd;
+        bool malformed = false;
+        auto now = LinkEmulator::Clock::now();
+        auto deliver = [&](const std::vector<uint8_t>& frame) {
+            LinkCounters::add(link->counters.frames_received);
+            malformed |= !link->mux.receive(frame, [&](BluetoothChannel channel, const std::vector<uint8_t>& message) {
+                if (link->emulator) {
+                    link->emulator->receive(channel, message, now);
+                } else {
+                    dispatch(device_id, channel, message);
+                }
+            });
+        };
+        while (true) {
+            ssize_t bytes_read = read(fd, read_buffer.data(), read_buffer.size());
+            LinkCounters::add(link->counters.read_calls);
+            if (bytes_read > 0) {
+                LinkCounters::add(link->counters.bytes_received, bytes_read);
+                if (!link->decoder.feed(read_buffer.data(), bytes_read, deliver) || malformed) {
+                    remove_connection(link); // Frame boundaries are lost; drop the link
+                    return;
+                }
+            } else if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (link->emulator) {
+                    link->emulator->deliver_due(LinkEmulator::Clock::now(), [&](BluetoothChannel channel, const std::vector<uint8_t>& message) {
+                        dispatch(device_id, channel, message);
+                    });
+                }
+                return;
+            } else {
+                remove_connection(link); // Peer closed or the link failed
+                return;
+            }
+        }
+    }
+
+    void request_flush(const std::shared_ptr<Connection>& connection) {
+        {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            flush_requests.push_back(connection);
+        }
+        wake();
+    }
+
+    // Writes queued frames until the queue is empty or the socket is full; an
+    // EPOLLOUT edge brings the reactor back once the link drains
+    void flush_connection(const std::shared_ptr<Connection>& link) {
+        int fd = link->fd;
+        bool ready = false;
+        ChannelMux::Slice slices[MAX_IOV];
+        struct iovec iov[MAX_IOV];
+        while (true) {
+            size_t count = link->mux.gather(slices, MAX_IOV);
+            if (link->emulator) link->emulator->set_send_blocked(false);
+            if (count == 0) break;
+            size_t budget = link->emulator ? link->emulator->send_budget(LinkEmulator::Clock::now()) : SIZE_MAX;
+            if (budget == 0) {
+                link->emulator->set_send_blocked(true); // The reactor's timer resumes the paced link
+                break;
+            }
+            size_t iov_count = 0;
+            size_t requested = 0;
+            for (size_t i = 0; i < count && budget > 0; ++i) {
+                iov[i].iov_base = const_cast<uint8_t*>(slices[i].data);
+                iov[i].iov_len = std::min(slices[i].length, budget);
+                budget -= iov[i].iov_len;
+                requested += iov[i].iov_len;
+                ++iov_count;
+            }
+            // sendmsg rather than writev so a peer that hung up fails the write instead of raising SIGPIPE
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            ssize_t bytes_written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            LinkCounters::add(link->counters.write_calls);
+            if (bytes_written > 0) {
+                LinkCounters::add(link->counters.bytes_sent, bytes_written);
+                if (static_cast<size_t>(bytes_written) < requested) LinkCounters::add(link->counters.partial_writes);
+                if (link->emulator) link->emulator->sent(bytes_written);
+                ready |= link->mux.consume(bytes_written);
+            } else if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                remove_connection(link);
+                return;
+            }
+        }
+        if (ready && ready_callback) {
+            ready_callback(link->device_id);
+        }
+    }
+
+    // Runs link emulation timers: delivers messages whose latency has passed,
+    // resumes paced writes and drops links due to disconnect. Returns the
+    // epoll_wait timeout until the next one, -1 if none.
+    int service_emulators() {
+        auto now = LinkEmulator::Clock::now();
+        auto next = LinkEmulator::Clock::time_point::max();
+        auto snapshot = connection_fds.snapshot();
+        for (const auto& [fd, link] : snapshot) {
+            if (!link->emulator) continue;
+            if (link->emulator->disconnect_due(now)) {
+                remove_connection(link);
+                continue;
+            }
+            link->emulator->deliver_due(now, [&](BluetoothChannel channel, const std::vector<uint8_t>& message) {
+                dispatch(link->device_id, channel, message);
+            });
+            if (link->emulator->send_ready(now)) flush_connection(link);
+            next = std::min(next, link->emulator->next_deadline());
+        }
+        if (next == LinkEmulator::Clock::time_point::max()) return -1;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - LinkEmulator::Clock::now()).count();
+        return static_cast<int>(std::max<int64_t>(wait + 1, 0)); // Round up so the deadline has passed on wakeup
+    }
+
+    // Single reactor for every RFCOMM socket, reading and writing; sleeps in
+    // epoll_wait until a socket, the eventfd or an emulation timer is ready,
+    // so it costs nothing while idle
     void receive_worker() {
+        struct epoll_event events[MAX_EVENTS];
         while (running) {
-            for (auto& conn : connections) {
-                fd_set readfds;
-                FD_ZERO(&readfds);
-                FD_SET(conn.second, &readfds);
-                struct timeval tv = {0, 100000}; // 100ms timeout
-                if (select(conn.second + 1, &readfds, NULL, NULL, &tv) > 0) {
-                    char buffer[1024];
-                    ssize_t bytes_read = read(conn.second, buffer, sizeof(buffer));
-                    if (bytes_read > 0) {
-                        std::vector<uint8_t> data(buffer, buffer + bytes_read);
-                        if (receive_callback) {
-                            receive_callback(conn.first, data);
-                        }
+            int timeout = -1;
+            if (backend == BluetoothBackend::LOOPBACK) {
+                int emulator_timeout = service_emulators();
+                int hello_timeout = expire_hellos();
+                timeout = emulator_timeout < 0 || (hello_timeout >= 0 && hello_timeout < emulator_timeout) ? hello_timeout : emulator_timeout;
+            }
+            int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (int i = 0; i < count && running; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    accept_loopback();
+                    continue;
+                }
+                if (fd == wake_fd) {
+                    uint64_t value;
+                    (void)read(wake_fd, &value, sizeof(value));
+                    std::vector<std::shared_ptr<Connection>> requests;
+                    {
+                        std::lock_guard<std::mutex> lock(flush_mutex);
+                        requests.swap(flush_requests);
                     }
+                    for (const auto& request : requests) flush_connection(request);
+                    continue;
+                }
+                if (pending_hellos.count(fd)) {
+                    read_hello(fd);
+                    continue;
+                }
+                auto connection = connection_fds.find(fd);
+                if (!connection) continue; // Removed earlier in this batch
+                if (events[i].events & EPOLLIN) {
+                    read_connection(connection); // Also picks up the EOF behind EPOLLRDHUP
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                    remove_connection(connection);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush_connection(connection); // Fails fast if the read above dropped the link
                 }
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
     }
 };
 
-Bluetooth::Bluetooth() : pimpl(std::make_unique<Impl>()) {}
+static BluetoothBackend backend_from_environment() {
+    const char* backend = std::getenv("BLUEBEAM_BT_BACKEND");
+    return backend && std::strcmp(backend, "loopback") == 0 ? BluetoothBackend::LOOPBACK : BluetoothBackend::NATIVE;
+}
+
+static std::string loopback_id_from_environment() {
+    const char* id = std::getenv("BLUEBEAM_BT_LOOPBACK_ID");
+    return id ? id : "";
+}
+
+Bluetooth::Bluetooth() : Bluetooth(backend_from_environment(), loopback_id_from_environment()) {}
+
+Bluetooth::Bluetooth(BluetoothBackend backend, const std::string& local_id)
+    : pimpl(std::make_unique<Impl>(backend, local_id)) {}
 
 Bluetooth::~Bluetooth() = default;
 
 void Bluetooth::scan() {
+    if (pimpl->backend == BluetoothBackend::LOOPBACK) {
+        DIR* dir = opendir(pimpl->loopback_dir.c_str());
+        if (!dir) return;
+        std::string suffix = Impl::LOOPBACK_SUFFIX;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+            std::string device_id = name.substr(0, name.size() - suffix.size());
+            if (device_id != pimpl->local_id) {
+                pimpl->discovered_devices[device_id] = device_id;
+            }
+        }
+        closedir(dir);
+        return;
+    }
     if (pimpl->conn) {
         DBusMessage* msg = dbus_message_new_method_call("org.bluez", "/org/bluez/hci0", "org.bluez.Adapter1", "StartDiscovery");
         dbus_connection_send(pimpl->conn, msg, nullptr);
@@ -73,7 +524,19 @@ void Bluetooth::scan() {
 }
 
 bool Bluetooth::connect(const std::string& device_id) {
-    int sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    if (pimpl->backend == BluetoothBackend::LOOPBACK) {
+        struct sockaddr_un addr;
+        if (!Impl::loopback_address(pimpl->loopback_path(device_id), addr)) return false;
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) return false;
+        if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || !Impl::send_hello(sock, pimpl->local_id)) {
+            close(sock);
+            return false;
+        }
+        return pimpl->add_connection(device_id, sock);
+    }
+
+    int sock = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC, BTPROTO_RFCOMM);
     if (sock < 0) return false;
 
     struct sockaddr_rc addr = {0};
@@ -81,28 +544,91 @@ bool Bluetooth::connect(const std::string& device_id) {
     str2ba(device_id.c_str(), &addr.rc_bdaddr);
     addr.rc_channel = 1;
 
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         close(sock);
         return false;
     }
 
-    pimpl->connections[device_id] = sock;
+    return pimpl->add_connection(device_id, sock);
+}
+
+// Queues the message for the reactor and returns at once; is_writable and the
+// ready callback let producers hold off while the link is backed up
+bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel) {
+    auto connection = pimpl->connections.find(device_id);
+    if (!connection) return false;
+
+    bool was_idle = false;
+    if (!connection->mux.enqueue(channel, data, was_idle)) return false;
+    if (was_idle) pimpl->request_flush(connection);
     return true;
 }
 
-bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data) {
-    auto it = pimpl->connections.find(device_id);
-    if (it != pimpl->connections.end()) {
-        ssize_t bytes_written = write(it->second, data.data(), data.size());
-        return bytes_written == (ssize_t)data.size();
+bool Bluetooth::connect_loopback_pair(Bluetooth& a, const std::string& a_id, Bluetooth& b, const std::string& b_id) {
+    if (a.pimpl->backend != BluetoothBackend::LOOPBACK || b.pimpl->backend != BluetoothBackend::LOOPBACK) return false;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return false;
+    if (!a.pimpl->add_connection(b_id, sv[0])) {
+        close(sv[1]);
+        return false;
+    }
+    return b.pimpl->add_connection(a_id, sv[1]); // On failure a sees the hangup and drops its end
+}
+
+bool Bluetooth::is_connected(const std::string& device_id) {
+    return pimpl->connections.find(device_id) != nullptr;
+}
+
+bool Bluetooth::is_writable(const std::string& device_id) {
+    auto connection = pimpl->connections.find(device_id);
+    return connection && connection->mux.writable();
+}
+
+void Bluetooth::set_ready_callback(std::function<void(const std::string& device_id)> callback) {
+    pimpl->ready_callback = callback;
+}
+
+bool Bluetooth::set_link_profile(const std::string& device_id, const LinkProfile& profile) {
+    auto connection = pimpl->connections.find(device_id);
+    if (!connection || !connection->emulator) return false;
+    connection->emulator->set_profile(profile);
+    pimpl->wake(); // Recompute the reactor's timer
+    return true;
+}
+
+bool Bluetooth::get_link_stats(const std::string& device_id, LinkStats& stats) {
+    auto connection = pimpl->connections.find(device_id);
+    if (!connection) return false;
+    stats = LinkStats();
+    connection->counters.read(stats);
+    connection->mux.read_stats(stats);
+    return true;
+}
+
+void Bluetooth::record_rtt_sample(const std::string& device_id, std::chrono::microseconds rtt) {
+    if (auto connection = pimpl->connections.find(device_id)) {
+        connection->counters.add_rtt_sample(rtt);
     }
-    return false;
 }
 
 void Bluetooth::set_receive_callback(std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
     pimpl->receive_callback = callback;
 }
 
+void Bluetooth::set_channel_receive_callback(BluetoothChannel channel, std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
+    pimpl->channel_callbacks[static_cast<size_t>(channel)] = callback;
+}
+
+void Bluetooth::set_disconnect_callback(std::function<void(const std::string& device_id)> callback) {
+    pimpl->disconnect_callback = callback;
+}
+
+void Bluetooth::call_disconnect_callback(const std::string& device_id) {
+    if (pimpl->disconnect_callback) {
+        pimpl->disconnect_callback(device_id);
+    }
+}
+
 std::vector<std::string> Bluetooth::get_discovered_devices() {
     std::vector<std::string> devices;
     for (const auto& pair : pimpl->discovered_devices) {
@@ -1,14 +1,38 @@
 #include "bluetooth.h"
+#include "frame_codec.h"
+#include "channel_mux.h"
+#include "connection_registry.h"
+#include "link_stats.h"
 #include <windows.h>
 #include <bluetoothapis.h>
 #include <ws2bth.h>
 #include <thread>
 #include <unordered_map>
+#include <array>
+#include <mutex>
 
 class Bluetooth::Impl {
 public:
+    static constexpr DWORD READ_BUFFER_SIZE = 64 * 1024; // A full file chunk per read
+
     std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> receive_callback;
-    std::unordered_map<std::string, HANDLE> connections;
+    std::function<void(const std::string& device_id)> ready_callback;
+    std::function<void(const std::string& device_id)> disconnect_callback;
+    std::array<std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)>, ChannelMux::CHANNEL_COUNT> channel_callbacks;
+    static constexpr size_t MAX_SLICES = 64;
+
+    // Owns the socket; it is closed once the last sender lets go
+    struct Link {
+        explicit Link(HANDLE handle) : handle(handle) {}
+        ~Link() { CloseHandle(handle); }
+        const HANDLE handle;
+        ChannelMux mux;
+        std::mutex write_mutex; // One sender drains the queue at a time
+        FrameDecoder decoder;   // Receive thread only
+        LinkCounters counters;
+    };
+    ConnectionRegistry<std::string, Link> links;
+    std::vector<uint8_t> read_buffer = std::vector<uint8_t>(READ_BUFFER_SIZE);
     std::unordered_map<std::string, BLUETOOTH_DEVICE_INFO> discovered_devices;
     std::thread receive_thread;
     bool running = true;
@@ -19,23 +43,88 @@ public:
     ~Impl() {
         running = false;
         if (receive_thread.joinable()) receive_thread.join();
-        for (auto& conn : connections) {
-            CloseHandle(conn.second);
+        links.clear();
+    }
+
+    void dispatch(const std::string& device_id, BluetoothChannel channel, const std::vector<uint8_t>& message) {
+        auto& callback = channel_callbacks[static_cast<size_t>(channel)];
+        if (callback) {
+            callback(device_id, message);
+        } else if (receive_callback) {
+            receive_callback(device_id, message);
+        }
+    }
+
+    // Closes the link once its last holder lets go; only the caller that actually
+    // removed it reports the disconnect
+    void drop_link(const std::string& device_id, const Link* link) {
+        if (links.remove(device_id, link) && disconnect_callback) {
+            disconnect_callback(device_id);
+        }
+    }
+
+    // There is no reactor on this platform, so the sender writes what is queued
+    // itself, coalescing the staged slices into one WriteFile
+    bool flush(const std::string& device_id, Link& link) {
+        bool ready = false;
+        bool failed = false;
+        ChannelMux::Slice slices[MAX_SLICES];
+        std::vector<uint8_t> batch;
+        {
+            std::lock_guard<std::mutex> lock(link.write_mutex);
+            while (size_t count = link.mux.gather(slices, MAX_SLICES)) {
+                batch.clear();
+                for (size_t i = 0; i < count; ++i) {
+                    batch.insert(batch.end(), slices[i].data, slices[i].data + slices[i].length);
+                }
+                DWORD bytes_written = 0;
+                BOOL written = WriteFile(link.handle, batch.data(), batch.size(), &bytes_written, NULL);
+                LinkCounters::add(link.counters.write_calls);
+                if (!written) {
+                    failed = true;
+                    break;
+                }
+                LinkCounters::add(link.counters.bytes_sent, bytes_written);
+                if (bytes_written < batch.size()) LinkCounters::add(link.counters.partial_writes);
+                ready |= link.mux.consume(bytes_written);
+            }
+        }
+        if (failed) {
+            drop_link(device_id, &link); // A dead link must stop reporting is_connected
+            return false;
+        }
+        if (ready && ready_callback) {
+            ready_callback(device_id);
         }
+        return true;
     }
 
     void receive_worker() {
         while (running) {
-            for (auto& conn : connections) {
+            std::vector<std::pair<std::string, Link*>> dropped;
+            auto snapshot = links.snapshot();
+            for (const auto& [device_id, entry] : snapshot) {
+                Link& link = *entry;
                 DWORD bytes_read;
-                char buffer[1024];
-                if (ReadFile(conn.second, buffer, sizeof(buffer), &bytes_read, NULL) && bytes_read > 0) {
-                    std::vector<uint8_t> data(buffer, buffer + bytes_read);
-                    if (receive_callback) {
-                        receive_callback(conn.first, data);
-                    }
+                BOOL read = ReadFile(link.handle, read_buffer.data(), READ_BUFFER_SIZE, &bytes_read, NULL);
+                LinkCounters::add(link.counters.read_calls);
+                if (read && bytes_read > 0) {
+                    LinkCounters::add(link.counters.bytes_received, bytes_read);
+                    bool malformed = false;
+                    bool ok = link.decoder.feed(read_buffer.data(), bytes_read, [&](const std::vector<uint8_t>& frame) {
+                        LinkCounters::add(link.counters.frames_received);
+                        malformed |= !link.mux.receive(frame, [&](BluetoothChannel channel, const std::vector<uint8_t>& message) {
+                            dispatch(device_id, channel, message);
+                        });
+                    });
+                    if (!ok || malformed) dropped.emplace_back(device_id, &link); // Frame boundaries are lost
+                } else {
+                    dropped.emplace_back(device_id, &link); // Read failed or the peer closed
                 }
             }
+            for (const auto& [device_id, link] : dropped) {
+                drop_link(device_id, link);
+            }
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
     }
@@ -43,6 +132,13 @@ public:
 
 Bluetooth::Bluetooth() : pimpl(std::make_unique<Impl>()) {}
 
+// The loopback backend is Linux-only for now; other backends always use the radio
+Bluetooth::Bluetooth(BluetoothBackend, const std::string&) : Bluetooth() {}
+
+bool Bluetooth::connect_loopback_pair(Bluetooth&, const std::string&, Bluetooth&, const std::string&) {
+    return false;
+}
+
 Bluetooth::~Bluetooth() = default;
 
 void Bluetooth::scan() {
@@ -88,27 +184,71 @@ bool Bluetooth::connect(const std::string& device_id) {
             return false;
         }
 
-        pimpl->connections[device_id] = (HANDLE)s;
+        pimpl->links.insert(device_id, std::make_shared<Impl::Link>((HANDLE)s));
         return true;
     }
     return false;
 }
 
-bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data) {
-    auto it = pimpl->connections.find(device_id);
-    if (it != pimpl->connections.end()) {
-        DWORD bytes_written;
-        if (WriteFile(it->second, data.data(), data.size(), &bytes_written, NULL)) {
-            return bytes_written == data.size();
-        }
-    }
+bool Bluetooth::send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel) {
+    auto link = pimpl->links.find(device_id);
+    if (!link) return false;
+    bool was_idle = false;
+    if (!link->mux.enqueue(channel, data, was_idle)) return false;
+    return pimpl->flush(device_id, *link);
+}
+
+bool Bluetooth::is_connected(const std::string& device_id) {
+    return pimpl->links.find(device_id) != nullptr;
+}
+
+bool Bluetooth::is_writable(const std::string& device_id) {
+    auto link = pimpl->links.find(device_id);
+    return link && link->mux.writable();
+}
+
+// Link shaping needs the loopback backend, which is Linux-only for now
+bool Bluetooth::set_link_profile(const std::string&, const LinkProfile&) {
     return false;
 }
 
+bool Bluetooth::get_link_stats(const std::string& device_id, LinkStats& stats) {
+    auto link = pimpl->links.find(device_id);
+    if (!link) return false;
+    stats = LinkStats();
+    link->counters.read(stats);
+    link->mux.read_stats(stats);
+    return true;
+}
+
+void Bluetooth::record_rtt_sample(const std::string& device_id, std::chrono::microseconds rtt) {
+    if (auto link = pimpl->links.find(device_id)) {
+        link->counters.add_rtt_sample(rtt);
+    }
+}
+
+void Bluetooth::set_ready_callback(std::function<void(const std::string& device_id)> callback) {
+    pimpl->ready_callback = callback;
+}
+
 void Bluetooth::set_receive_callback(std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
     pimpl->receive_callback = callback;
 }
 
+void Bluetooth::set_channel_receive_callback(BluetoothChannel channel, std::function<void(const std::string& device_id, const std::vector<uint8_t>& data)> callback) {
+    pimpl->channel_callbacks[static_cast<size_t>(channel)] = callback;
+}
+
+void Bluetooth::set_disconnect_callback(std::function<void(const std::string& device_id)> callback) {
+    pimpl->disconnect_callback = callback;
+}
+
+void Bluetooth::call_disconnect_callback(const std::string& device_id) {
+    if (pimpl->disconnect_callback) {
+        pimpl->disconnect_callback(device_id);
+    }
+}
+
 std::vector<std::string> Bluetooth::get_discovered_devices() {
     std::vector<std::string> devices;
     for (const auto& pair : pimpl->discovered_devices) {
@@ -0,0 +1,117 @@
+#include "channel_mux.h"
+#include <algorithm>
+
+bool ChannelMux::enqueue(BluetoothChannel channel, const std::vector<uint8_t>& data, bool& was_idle) {
+    size_t index = static_cast<size_t>(channel);
+    if (index >= CHANNEL_COUNT || data.size() > MAX_MESSAGE_SIZE) return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queued_bytes + data.size() > MAX_QUEUED_BYTES) return false;
+    was_idle = staged.empty() && std::all_of(queues.begin(), queues.end(), [](const auto& queue) { return queue.empty(); });
+    queues[index].push_back({std::make_shared<const std::vector<uint8_t>>(data)});
+    queued_bytes += data.size();
+    if (queued_bytes >= HIGH_WATERMARK) above_high = true;
+    return true;
+}
+
+// Commits fragments to the wire order, highest priority first, until
+// STAGE_BYTES are waiting. Called with the mutex held.
+void ChannelMux::stage() {
+    while (staged_bytes < STAGE_BYTES) {
+        size_t index = 0;
+        while (index < CHANNEL_COUNT && queues[index].empty()) ++index;
+        if (index == CHANNEL_COUNT) return;
+
+        Outgoing& next = queues[index].front();
+        Fragment fragment;
+        fragment.data = next.data;
+        fragment.offset = next.offset;
+        fragment.length = std::min(FRAGMENT_SIZE, next.data->size() - next.offset);
+        bool last = next.offset + fragment.length == next.data->size();
+        write_frame_header(fragment.head, MUX_HEADER_SIZE + fragment.length);
+        fragment.head[FRAME_HEADER_SIZE] = static_cast<uint8_t>(index);
+        fragment.head[FRAME_HEADER_SIZE + 1] = last ? FLAG_END : 0;
+
+        next.offset += fragment.length;
+        if (last) queues[index].pop_front();
+        staged_bytes += sizeof(fragment.head) + fragment.length;
+        staged.push_back(std::move(fragment));
+    }
+}
+
+size_t ChannelMux::gather(Slice* out, size_t max_slices) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stage();
+    size_t count = 0;
+    for (const auto& fragment : staged) {
+        if (count == max_slices) break;
+        if (fragment.written < sizeof(fragment.head)) {
+            out[count++] = {fragment.head + fragment.written, sizeof(fragment.head) - fragment.written};
+        }
+        if (count == max_slices) break;
+        size_t body_written = fragment.written > sizeof(fragment.head) ? fragment.written - sizeof(fragment.head) : 0;
+        if (fragment.length > body_written) {
+            out[count++] = {fragment.data->data() + fragment.offset + body_written, fragment.length - body_written};
+        }
+    }
+    return count;
+}
+
+bool ChannelMux::consume(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (bytes > 0 && !staged.empty()) {
+        Fragment& fragment = staged.front();
+        size_t total = sizeof(fragment.head) + fragment.length;
+        size_t taken = std::min(bytes, total - fragment.written);
+        fragment.written += taken;
+        staged_bytes -= taken;
+        bytes -= taken;
+        if (fragment.written == total) {
+            queued_bytes -= fragment.length;
+            ++frames_sent;
+            staged.pop_front();
+        }
+    }
+    if (above_high && queued_bytes <= LOW_WATERMARK) {
+        above_high = false;
+        return true;
+    }
+    return false;
+}
+
+bool ChannelMux::writable() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued_bytes < HIGH_WATERMARK;
+}
+
+void ChannelMux::read_stats(LinkStats& stats) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.queued_bytes = queued_bytes;
+    stats.frames_sent = frames_sent;
+}
+
+bool ChannelMux::receive(const std::vector<uint8_t>& frame, const MessageHandler& handler) {
+    if (frame.size() < MUX_HEADER_SIZE) return false;
+    size_t index = frame[0];
+    bool last = frame[1] & FLAG_END;
+    if (index >= CHANNEL_COUNT) return true; // A channel from a newer peer; skip it
+
+    auto channel = static_cast<BluetoothChannel>(index);
+    std::vector<uint8_t>& buffer = partial[index];
+    if (buffer.empty() && last) {
+        handler(channel, std::vector<uint8_t>(frame.begin() + MUX_HEADER_SIZE, frame.end()));
+        return true;
+    }
+    if (buffer.size() + frame.size() - MUX_HEADER_SIZE > MAX_MESSAGE_SIZE) return false;
+    buffer.insert(buffer.end(), frame.begin() + MUX_HEADER_SIZE, frame.end());
+    if (last) {
+        std::vector<uint8_t> message;
+        message.swap(buffer);
+        handler(channel, message);
+    }
+    return true;
+}
+
+void ChannelMux::reset_receive() {
+    for (auto& buffer : partial) buffer.clear();
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "bluetooth.h"
+#include "frame_codec.h"
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+// Multiplexes logical channels over one framed connection. Messages are cut
+// into fragments carrying [channel][flags] after the frame length, and the
+// link always takes the next fragment from the highest-priority channel, so
+// chat and control traffic wait behind only the few bulk fragments already
+// staged for the socket.
+//
+// Sending is split between producers, which enqueue from any thread, and a
+// single writer that gathers staged bytes, writes what the link takes and
+// reports it back through consume().
+class ChannelMux {
+public:
+    static constexpr size_t CHANNEL_COUNT = 3;
+    static constexpr size_t MUX_HEADER_SIZE = 2;
+    static constexpr size_t FRAGMENT_SIZE = 4096;
+    static constexpr size_t STAGE_BYTES = 16 * 1024; // Committed ahead of priority; bounds a chat message's wait
+    static constexpr size_t MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+    static constexpr size_t HIGH_WATERMARK = 256 * 1024; // Producers should pause above this
+    static constexpr size_t LOW_WATERMARK = 64 * 1024;   // ...and are told to resume below this
+    static constexpr size_t MAX_QUEUED_BYTES = 8 * 1024 * 1024; // Sends are refused beyond this
+    static constexpr uint8_t FLAG_END = 0x01; // Last fragment of a message
+
+    struct Slice {
+        const uint8_t* data;
+        size_t length;
+    };
+    using MessageHandler = std::function<void(BluetoothChannel channel, const std::vector<uint8_t>& message)>;
+
+    // Queues a message without blocking. was_idle tells the caller the writer
+    // had nothing to do and needs a kick. Fails if the message is too large or
+    // the queue is past MAX_QUEUED_BYTES.
+    bool enqueue(BluetoothChannel channel, const std::vector<uint8_t>& data, bool& was_idle);
+
+    // Writer side: fills out with up to max_slices pieces of pending wire bytes,
+    // in order, and returns how many. Slices stay valid until consumed.
+    size_t gather(Slice* out, size_t max_slices);
+    // Retires bytes the link accepted. Returns true when the queue drains below
+    // LOW_WATERMARK after having crossed HIGH_WATERMARK.
+    bool consume(size_t bytes);
+
+    bool writable();
+    // Fills the outbound queue depth and frames written so far
+    void read_stats(LinkStats& stats);
+
+    // Feeds one decoded frame, calling handler for each completed message.
+    // Returns false on a malformed frame. Reader thread only.
+    bool receive(const std::vector<uint8_t>& frame, const MessageHandler& handler);
+    void reset_receive(); // Drops partial messages after the stream lost sync
+
+private:
+    struct Outgoing {
+        std::shared_ptr<const std::vector<uint8_t>> data;
+        size_t offset = 0;
+    };
+    struct Fragment {
+        uint8_t head[FRAME_HEADER_SIZE + MUX_HEADER_SIZE];
+        std::shared_ptr<const std::vector<uint8_t>> data;
+        size_t offset;
+        size_t length;
+        size_t written = 0; // Bytes of head and body already on the wire
+    };
+
+    void stage();
+
+    std::mutex mutex;
+    std::array<std::deque<Outgoing>, CHANNEL_COUNT> queues;
+    std::deque<Fragment> staged; // Fixed wire order; only the writer stages and consumes
+    size_t staged_bytes = 0;     // Unwritten wire bytes in staged
+    size_t queued_bytes = 0;     // Payload bytes accepted but not yet written
+    bool above_high = false;
+    uint64_t frames_sent = 0;
+
+    std::array<std::vector<uint8_t>, CHANNEL_COUNT> partial; // Messages being reassembled
+};
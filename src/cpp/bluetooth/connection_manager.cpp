@@ -0,0 +1,251 @@
+#include "connection_manager.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+class ConnectionManager::Impl {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::chrono::milliseconds BASE_BACKOFF{500};
+    static constexpr std::chrono::milliseconds MAX_BACKOFF{30000};
+    static constexpr int OFFLINE_AFTER_ATTEMPTS = 3;
+    static constexpr size_t MAX_HELD_BYTES = 1024 * 1024; // Per peer while its link is down
+
+    struct HeldMessage {
+        BluetoothChannel channel;
+        std::vector<uint8_t> data;
+    };
+
+    struct Peer {
+        bool connected = false;
+        bool replaying = false; // Held messages are going out; new sends queue behind them
+        bool backed_up = false; // The link refused part of a replay; notify_link_ready resumes it
+        int attempts = 0;       // Failed reconnects since the link dropped
+        Clock::time_point next_attempt; // Next reconnect, or replay retry while connected
+        std::deque<HeldMessage> held;
+        size_t held_bytes = 0;
+    };
+
+    Bluetooth& bluetooth;
+    std::function<void(const std::string& device_id, bool online)> status_callback;
+    std::unordered_map<std::string, Peer> peers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::mt19937 rng{std::random_device{}()};
+    bool running = true;
+    std::thread worker;
+
+    Impl(Bluetooth& bt) : bluetooth(bt) {}
+
+    void start(const std::shared_ptr<Impl>& self) {
+        // The reactor may report a drop while the manager is going away, so the
+        // callback only holds a weak reference
+        bluetooth.set_disconnect_callback([weak = std::weak_ptr<Impl>(self)](const std::string& device_id) {
+            if (auto impl = weak.lock()) impl->on_disconnect(device_id);
+        });
+        worker = std::thread(&Impl::reconnect_worker, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+    void on_disconnect(const std::string& device_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = peers.find(device_id);
+        if (it != peers.end() && it->second.connected) {
+            mark_down(it->second);
+        }
+    }
+
+    // Equal jitter over an exponentially growing window: at least half the window,
+    // so a flapping link isn't retried at once, and a random rest, so peers that
+    // dropped together don't all come back at the same instant
+    Clock::duration backoff(int attempts) {
+        auto window = std::min(BASE_BACKOFF * (1 << std::min(attempts, 6)), MAX_BACKOFF);
+        std::uniform_int_distribution<long long> dist(window.count() / 2, window.count());
+        return std::chrono::milliseconds(dist(rng));
+    }
+
+    void mark_down(Peer& peer) {
+        peer.connected = false;
+        peer.backed_up = false;
+        peer.attempts = 0;
+        peer.next_attempt = Clock::now() + backoff(0);
+        cv.notify_one();
+    }
+
+    bool hold(Peer& peer, BluetoothChannel channel, const std::vector<uint8_t>& data) {
+        if (peer.held_bytes + data.size() > MAX_HELD_BYTES) return false;
+        peer.held_bytes += data.size();
+        peer.held.push_back({channel, data});
+        return true;
+    }
+
+    // Hands held messages to the link in order. Returns false if the link
+    // refused one, which is left at the front for the next attempt.
+    bool replay(const std::string& device_id, std::unique_lock<std::mutex>& lock) {
+        auto it = peers.find(device_id);
+        it->second.replaying = true;
+        while (!it->second.held.empty()) {
+            HeldMessage message = std::move(it->second.held.front());
+            it->second.held.pop_front();
+            lock.unlock();
+            bool sent = bluetooth.send_data(device_id, message.data, message.channel);
+            lock.lock();
+            it = peers.find(device_id);
+            if (it == peers.end()) return true; // Released meanwhile
+            if (!sent) {
+                it->second.held.push_front(std::move(message));
+                it->second.replaying = false;
+                return false;
+            }
+            it->second.held_bytes -= message.data.size();
+        }
+        it->second.replaying = false;
+        return true;
+    }
+
+    // Replays what is held for a connected peer. A refusal from a link that is
+    // still up is backpressure, not a drop: the peer stays connected and the
+    // rest goes once the link has drained.
+    void resume_replay(const std::string& device_id, std::unique_lock<std::mutex>& lock) {
+        if (replay(device_id, lock)) return;
+        auto it = peers.find(device_id);
+        if (it == peers.end() || !it->second.connected) return; // Released, or its drop was reported meanwhile
+        Peer& peer = it->second;
+        if (!bluetooth.is_connected(device_id)) {
+            mark_down(peer);
+        } else if (!bluetooth.is_writable(device_id)) {
+            peer.backed_up = true; // The ready callback comes once it drains, and waits for our lock
+        } else {
+            peer.next_attempt = Clock::now() + backoff(0); // Refused for some other reason; try again shortly
+        }
+    }
+
+    void reconnect_worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            auto now = Clock::now();
+            auto wake = Clock::time_point::max();
+            const std::string* due = nullptr;
+            for (const auto& [device_id, peer] : peers) {
+                // A connected peer only has work while a replay is unfinished and not waiting on the link
+                if (peer.connected && (peer.held.empty() || peer.replaying || peer.backed_up)) continue;
+                if (peer.next_attempt <= now) {
+                    due = &device_id;
+                    break;
+                }
+                wake = std::min(wake, peer.next_attempt);
+            }
+            if (!due) {
+                if (wake == Clock::time_point::max()) {
+                    cv.wait(lock);
+                } else {
+                    cv.wait_until(lock, wake);
+                }
+                continue;
+            }
+
+            std::string device_id = *due;
+            std::optional<bool> status;
+            if (!peers[device_id].connected) {
+                // Connecting can take seconds; sends keep being held meanwhile.
+                // The peer may also have reconnected to us first.
+                lock.unlock();
+                bool connected = bluetooth.is_connected(device_id) || bluetooth.connect(device_id);
+                lock.lock();
+                auto it = peers.find(device_id);
+                if (it == peers.end()) continue; // Released while connecting
+
+                Peer& peer = it->second;
+                if (connected) {
+                    peer.connected = true;
+                    peer.attempts = 0;
+                    status = true;
+                } else {
+                    ++peer.attempts;
+                    peer.next_attempt = Clock::now() + backoff(peer.attempts);
+                    if (peer.attempts == OFFLINE_AFTER_ATTEMPTS) status = false;
+                }
+            }
+            if (peers[device_id].connected) resume_replay(device_id, lock);
+
+            if (status && status_callback) {
+                auto callback = status_callback;
+                lock.unlock();
+                callback(device_id, *status);
+                lock.lock();
+            }
+        }
+    }
+};
+
+ConnectionManager::ConnectionManager(Bluetooth& bluetooth) : pimpl(std::make_shared<Impl>(bluetooth)) {
+    pimpl->start(pimpl);
+}
+
+ConnectionManager::~ConnectionManager() {
+    pimpl->stop();
+}
+
+void ConnectionManager::keep_connected(const std::string& device_id) {
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    if (pimpl->peers.count(device_id)) return;
+    Impl::Peer& peer = pimpl->peers[device_id];
+    peer.connected = pimpl->bluetooth.is_connected(device_id);
+    peer.next_attempt = Impl::Clock::now(); // Warm it up right away
+    pimpl->cv.notify_one();
+}
+
+void ConnectionManager::release(const std::string& device_id) {
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    pimpl->peers.erase(device_id);
+}
+
+bool ConnectionManager::send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel) {
+    {
+        std::lock_guard<std::mutex> lock(pimpl->mutex);
+        auto it = pimpl->peers.find(device_id);
+        if (it != pimpl->peers.end()) {
+            Impl::Peer& peer = it->second;
+            if (!peer.connected || peer.replaying || !peer.held.empty()) {
+                return pimpl->hold(peer, channel, data);
+            }
+        }
+    }
+    if (pimpl->bluetooth.send_data(device_id, data, channel)) return true;
+
+    // The link may have dropped before its disconnect was reported
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    auto it = pimpl->peers.find(device_id);
+    if (it == pimpl->peers.end() || pimpl->bluetooth.is_connected(device_id)) return false;
+    if (it->second.connected) pimpl->mark_down(it->second);
+    return pimpl->hold(it->second, channel, data);
+}
+
+void ConnectionManager::notify_link_ready(const std::string& device_id) {
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    auto it = pimpl->peers.find(device_id);
+    if (it == pimpl->peers.end() || !it->second.backed_up) return;
+    it->second.backed_up = false;
+    it->second.next_attempt = Impl::Clock::now();
+    pimpl->cv.notify_one();
+}
+
+void ConnectionManager::set_status_callback(std::function<void(const std::string& device_id, bool online)> callback) {
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    pimpl->status_callback = callback;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "bluetooth.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+
+// Keeps links to a set of peers warm. After a drop it reconnects in the
+// background with jittered exponential backoff, and messages sent meanwhile are
+// held and replayed in order once the link is back. Peers that aren't kept are
+// passed straight through to Bluetooth.
+class ConnectionManager {
+public:
+    // Takes over the Bluetooth disconnect callback
+    explicit ConnectionManager(Bluetooth& bluetooth);
+    ~ConnectionManager();
+
+    void keep_connected(const std::string& device_id);
+    // Stops reconnecting and drops held messages; an open link is left as is
+    void release(const std::string& device_id);
+    // False when the peer is down and not kept, or its held messages are at the limit
+    bool send_data(const std::string& device_id, const std::vector<uint8_t>& data, BluetoothChannel channel = BluetoothChannel::MESSAGING);
+    // Resumes a replay the link refused for backpressure; call from the Bluetooth
+    // ready callback
+    void notify_link_ready(const std::string& device_id);
+    // online is true whenever a kept peer's link comes up, false once it has failed
+    // a few attempts in a row; reconnecting carries on at the capped backoff
+    void set_status_callback(std::function<void(const std::string& device_id, bool online)> callback);
+
+private:
+    class Impl;
+    std::shared_ptr<Impl> pimpl; // Shared with the disconnect callback
+};
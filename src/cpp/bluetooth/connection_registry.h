@@ -0,0 +1,58 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+// Read-mostly map of live connections. Lookups take a shared lock, so senders
+// and the reactor only wait while a connect or disconnect is changing the map,
+// never on each other. Entries are shared, so a connection removed while a
+// sender still holds it stays valid until that sender is done.
+template <typename Key, typename Connection>
+class ConnectionRegistry {
+public:
+    using Map = std::unordered_map<Key, std::shared_ptr<Connection>>;
+
+    std::shared_ptr<Connection> find(const Key& key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : it->second;
+    }
+
+    // A copy, so the caller can remove entries while walking it
+    Map snapshot() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return map;
+    }
+
+    // Returns the connection it replaced, if any
+    std::shared_ptr<Connection> insert(const Key& key, std::shared_ptr<Connection> connection) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::shared_ptr<Connection>& slot = map[key];
+        std::shared_ptr<Connection> replaced = std::move(slot);
+        slot = std::move(connection);
+        return replaced;
+    }
+
+    // Removes key only while it still maps to connection, so a late removal
+    // can't take out the connection that replaced it
+    bool remove(const Key& key, const Connection* connection) {
+        std::shared_ptr<Connection> removed; // Released after the lock, in case it's the last reference
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end() || it->second.get() != connection) return false;
+        removed = std::move(it->second);
+        map.erase(it);
+        return true;
+    }
+
+    void clear() {
+        Map cleared;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        cleared.swap(map);
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    Map map;
+};
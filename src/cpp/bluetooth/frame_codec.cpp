@@ -0,0 +1,79 @@
+#include "frame_codec.h"
+#include <algorithm>
+#include <cstring>
+
+static uint32_t read_frame_header(const uint8_t* in) {
+    return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+}
+
+void write_frame_header(uint8_t* out, uint32_t payload_length) {
+    out[0] = (payload_length >> 24) & 0xFF;
+    out[1] = (payload_length >> 16) & 0xFF;
+    out[2] = (payload_length >> 8) & 0xFF;
+    out[3] = payload_length & 0xFF;
+}
+
+std::vector<uint8_t> encode_frame(const uint8_t* data, size_t length) {
+    std::vector<uint8_t> frame(FRAME_HEADER_SIZE + length);
+    write_frame_header(frame.data(), length);
+    if (length) std::memcpy(frame.data() + FRAME_HEADER_SIZE, data, length);
+    return frame;
+}
+
+bool FrameDecoder::feed(const uint8_t* data, size_t length, const FrameHandler& handler) {
+    size_t pos = 0;
+    while (count == 0 && length - pos >= FRAME_HEADER_SIZE) {
+        uint32_t frame_length = read_frame_header(data + pos);
+        if (frame_length > MAX_FRAME_SIZE) return false;
+        if (length - pos - FRAME_HEADER_SIZE < frame_length) break;
+        const uint8_t* payload = data + pos + FRAME_HEADER_SIZE;
+        handler(std::vector<uint8_t>(payload, payload + frame_length));
+        pos += FRAME_HEADER_SIZE + frame_length;
+    }
+    push(data + pos, length - pos);
+
+    while (count >= FRAME_HEADER_SIZE) {
+        uint8_t header[FRAME_HEADER_SIZE];
+        peek(header, sizeof(header));
+        uint32_t frame_length = read_frame_header(header);
+        if (frame_length > MAX_FRAME_SIZE) return false;
+        if (count - FRAME_HEADER_SIZE < frame_length) break;
+        consume(FRAME_HEADER_SIZE);
+        std::vector<uint8_t> frame(frame_length);
+        peek(frame.data(), frame_length);
+        consume(frame_length);
+        handler(frame);
+    }
+    return true;
+}
+
+void FrameDecoder::push(const uint8_t* data, size_t length) {
+    if (length == 0) return;
+    if (count + length > ring.size()) {
+        size_t capacity = std::max<size_t>(ring.size(), 4096);
+        while (capacity < count + length) capacity *= 2;
+        std::vector<uint8_t> grown(capacity);
+        peek(grown.data(), count);
+        ring.swap(grown);
+        head = 0;
+    }
+    size_t mask = ring.size() - 1;
+    size_t tail = (head + count) & mask;
+    size_t first = std::min(length, ring.size() - tail);
+    std::memcpy(ring.data() + tail, data, first);
+    std::memcpy(ring.data(), data + first, length - first);
+    count += length;
+}
+
+void FrameDecoder::peek(uint8_t* out, size_t length) const {
+    if (length == 0) return;
+    size_t first = std::min(length, ring.size() - head);
+    std::memcpy(out, ring.data() + head, first);
+    std::memcpy(out + first, ring.data(), length - first);
+}
+
+void FrameDecoder::consume(size_t length) {
+    head = (head + length) & (ring.size() - 1);
+    count -= length;
+    if (count == 0) head = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+// Length-prefixed framing for stream transports: a 4-byte big-endian payload
+// length followed by the payload.
+static constexpr size_t FRAME_HEADER_SIZE = 4;
+static constexpr uint32_t MAX_FRAME_SIZE = 4 * 1024 * 1024; // Larger lengths mean the stream is out of sync
+
+void write_frame_header(uint8_t* out, uint32_t payload_length);
+std::vector<uint8_t> encode_frame(const uint8_t* data, size_t length);
+
+// Reassembles frames from arbitrary reads of one connection. Partial frames wait
+// in a ring buffer that grows to the largest frame seen; whole frames in a read
+// with nothing buffered are delivered without going through it.
+class FrameDecoder {
+public:
+    using FrameHandler = std::function<void(const std::vector<uint8_t>& frame)>;
+
+    // Returns false if the stream carries an impossible length; the connection
+    // should then be dropped, since frame boundaries are lost
+    bool feed(const uint8_t* data, size_t length, const FrameHandler& handler);
+
+    size_t buffered() const { return count; }
+
+private:
+    void push(const uint8_t* data, size_t length);
+    void peek(uint8_t* out, size_t length) const;
+    void consume(size_t length);
+
+    std::vector<uint8_t> ring; // Capacity is always a power of two
+    size_t head = 0;
+    size_t count = 0;
+};
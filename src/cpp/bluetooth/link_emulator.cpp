@@ -0,0 +1,149 @@
+#include "link_emulator.h"
+#include <algorithm>
+#include <sstream>
+
+LinkProfile LinkProfile::rfcomm() {
+    LinkProfile profile;
+    profile.bandwidth_bps = 2000000;
+    profile.latency_ms = 25; // 20-80 ms round trips
+    profile.jitter_ms = 15;
+    profile.burst_enter = 0.002;
+    profile.burst_exit = 0.3;
+    profile.burst_loss = 0.5;
+    return profile;
+}
+
+bool LinkProfile::parse(const std::string& spec, LinkProfile& profile) {
+    LinkProfile parsed;
+    std::stringstream stream(spec);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (item.empty()) continue;
+        if (item == "rfcomm") {
+            uint32_t seed = parsed.seed;
+            parsed = rfcomm();
+            parsed.seed = seed;
+            continue;
+        }
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        try {
+            if (key == "bandwidth") parsed.bandwidth_bps = std::stoull(value);
+            else if (key == "latency") parsed.latency_ms = std::stoul(value);
+            else if (key == "jitter") parsed.jitter_ms = std::stoul(value);
+            else if (key == "loss") parsed.loss = std::stod(value);
+            else if (key == "burst_enter") parsed.burst_enter = std::stod(value);
+            else if (key == "burst_exit") parsed.burst_exit = std::stod(value);
+            else if (key == "burst_loss") parsed.burst_loss = std::stod(value);
+            else if (key == "disconnect_after") parsed.disconnect_after_ms = std::stoul(value);
+            else if (key == "seed") parsed.seed = std::stoul(value);
+            else return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    profile = parsed;
+    return true;
+}
+
+LinkEmulator::LinkEmulator(const LinkProfile& profile, uint32_t seed) : rng(seed) {
+    set_profile(profile);
+}
+
+void LinkEmulator::set_profile(const LinkProfile& new_profile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = Clock::now();
+    profile = new_profile;
+    tokens = std::min<double>(tokens, BURST_BYTES);
+    refilled_at = now;
+    disconnect_at = profile.disconnect_after_ms ? now + std::chrono::milliseconds(profile.disconnect_after_ms) : Clock::time_point::max();
+}
+
+void LinkEmulator::refill(Clock::time_point now) {
+    double rate = profile.bandwidth_bps / 8.0;
+    tokens = std::min<double>(BURST_BYTES, tokens + rate * std::chrono::duration<double>(now - refilled_at).count());
+    refilled_at = now;
+}
+
+size_t LinkEmulator::send_budget(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (profile.bandwidth_bps == 0) return SIZE_MAX;
+    refill(now);
+    return tokens >= 1 ? static_cast<size_t>(tokens) : 0;
+}
+
+void LinkEmulator::sent(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (profile.bandwidth_bps) tokens -= bytes;
+}
+
+void LinkEmulator::set_send_blocked(bool blocked) {
+    std::lock_guard<std::mutex> lock(mutex);
+    send_blocked = blocked;
+}
+
+bool LinkEmulator::send_ready(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!send_blocked) return false;
+    if (profile.bandwidth_bps == 0) return true;
+    refill(now);
+    return tokens >= MIN_WRITE;
+}
+
+// Gilbert-Elliott: the link flips between a good and a bursty state per
+// message, each with its own loss rate
+bool LinkEmulator::lose() {
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    if (bursting ? chance(rng) < profile.burst_exit : chance(rng) < profile.burst_enter) {
+        bursting = !bursting;
+    }
+    return chance(rng) < (bursting ? profile.burst_loss : profile.loss);
+}
+
+void LinkEmulator::receive(BluetoothChannel channel, const std::vector<uint8_t>& message, Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (lose()) return;
+    int64_t delay_ms = profile.latency_ms;
+    if (profile.jitter_ms) {
+        std::uniform_int_distribution<int64_t> jitter(-static_cast<int64_t>(profile.jitter_ms), profile.jitter_ms);
+        delay_ms = std::max<int64_t>(0, delay_ms + jitter(rng));
+    }
+    // A link delivers in order, so jitter can delay a message but not reorder it
+    auto deliver_at = std::max(now + std::chrono::milliseconds(delay_ms), last_delivery);
+    last_delivery = deliver_at;
+    held.push_back({deliver_at, channel, message});
+}
+
+void LinkEmulator::deliver_due(Clock::time_point now, const MessageHandler& handler) {
+    std::deque<Held> due;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!held.empty() && held.front().deliver_at <= now) {
+            due.push_back(std::move(held.front()));
+            held.pop_front();
+        }
+    }
+    for (const auto& entry : due) {
+        handler(entry.channel, entry.message);
+    }
+}
+
+bool LinkEmulator::disconnect_due(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return now >= disconnect_at;
+}
+
+LinkEmulator::Clock::time_point LinkEmulator::next_deadline() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto deadline = disconnect_at;
+    if (!held.empty()) deadline = std::min(deadline, held.front().deliver_at);
+    if (send_blocked) {
+        double rate = profile.bandwidth_bps / 8.0;
+        double missing = std::max(0.0, MIN_WRITE - tokens);
+        auto wait = rate > 0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(missing / rate)) : Clock::duration::zero();
+        deadline = std::min(deadline, refilled_at + wait);
+    }
+    return deadline;
+}
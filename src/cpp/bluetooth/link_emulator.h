@@ -0,0 +1,60 @@
+#pragma once
+#include "bluetooth.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+
+// Shapes one loopback connection like a radio link. Egress is paced to the
+// profile's bandwidth where the outbound queue drains, so channel priority and
+// backpressure behave as on a slow link; ingress messages are lost in bursts
+// (Gilbert-Elliott) or held for the one-way latency, in order. Give both ends
+// the same profile for a symmetric link.
+class LinkEmulator {
+public:
+    using Clock = std::chrono::steady_clock;
+    using MessageHandler = std::function<void(BluetoothChannel channel, const std::vector<uint8_t>& message)>;
+
+    static constexpr size_t MIN_WRITE = 1024;    // Paced writes wait for at least this much budget
+    static constexpr size_t BURST_BYTES = 4096;  // Budget a quiet link can bank
+
+    LinkEmulator(const LinkProfile& profile, uint32_t seed);
+
+    void set_profile(const LinkProfile& profile);
+
+    // Egress: bytes the link may take now (SIZE_MAX when unshaped), and what was written
+    size_t send_budget(Clock::time_point now);
+    void sent(size_t bytes);
+    void set_send_blocked(bool blocked); // Queue has data but the budget ran out
+    bool send_ready(Clock::time_point now);
+
+    // Ingress: the message is dropped or held until its latency has passed
+    void receive(BluetoothChannel channel, const std::vector<uint8_t>& message, Clock::time_point now);
+    void deliver_due(Clock::time_point now, const MessageHandler& handler);
+
+    bool disconnect_due(Clock::time_point now);
+
+    // Earliest time the reactor has work here; max() if none
+    Clock::time_point next_deadline();
+
+private:
+    struct Held {
+        Clock::time_point deliver_at;
+        BluetoothChannel channel;
+        std::vector<uint8_t> message;
+    };
+
+    void refill(Clock::time_point now);
+    bool lose();
+
+    std::mutex mutex;
+    LinkProfile profile;
+    std::mt19937 rng;
+    double tokens = 0;
+    Clock::time_point refilled_at;
+    bool send_blocked = false;
+    bool bursting = false; // Gilbert-Elliott bad state
+    std::deque<Held> held;
+    Clock::time_point last_delivery;
+    Clock::time_point disconnect_at = Clock::time_point::max();
+};
@@ -0,0 +1,30 @@
+#include "link_stats.h"
+#include <algorithm>
+#include <cstdlib>
+
+void LinkCounters::add_rtt_sample(std::chrono::microseconds rtt) {
+    int64_t sample = std::max<int64_t>(rtt.count(), 0);
+    std::lock_guard<std::mutex> lock(rtt_mutex);
+    if (rtt_samples == 0) {
+        srtt_us = sample;
+        rttvar_us = sample / 2;
+    } else {
+        rttvar_us = (3 * rttvar_us + std::llabs(srtt_us - sample)) / 4;
+        srtt_us = (7 * srtt_us + sample) / 8;
+    }
+    ++rtt_samples;
+}
+
+void LinkCounters::read(LinkStats& stats) const {
+    stats.bytes_sent = bytes_sent.load(std::memory_order_relaxed);
+    stats.bytes_received = bytes_received.load(std::memory_order_relaxed);
+    stats.frames_received = frames_received.load(std::memory_order_relaxed);
+    stats.write_calls = write_calls.load(std::memory_order_relaxed);
+    stats.read_calls = read_calls.load(std::memory_order_relaxed);
+    stats.partial_writes = partial_writes.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(rtt_mutex);
+    stats.srtt_us = static_cast<uint32_t>(std::min<int64_t>(srtt_us, UINT32_MAX));
+    stats.rttvar_us = static_cast<uint32_t>(std::min<int64_t>(rttvar_us, UINT32_MAX));
+    stats.rtt_samples = rtt_samples;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "bluetooth.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+// Live counters for one connection. The thread doing the I/O bumps them and
+// get_link_stats reads them from any thread.
+class LinkCounters {
+public:
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> frames_received{0};
+    std::atomic<uint64_t> write_calls{0};
+    std::atomic<uint64_t> read_calls{0};
+    std::atomic<uint64_t> partial_writes{0};
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    // RFC 6298 smoothing: SRTT moves 1/8 of the way to each sample and RTTVAR
+    // 1/4 of the way to its deviation
+    void add_rtt_sample(std::chrono::microseconds rtt);
+
+    // Fills everything except the outbound figures, which the mux keeps
+    void read(LinkStats& stats) const;
+
+private:
+    mutable std::mutex rtt_mutex;
+    int64_t srtt_us = 0;
+    int64_t rttvar_us = 0;
+    uint64_t rtt_samples = 0;
+};
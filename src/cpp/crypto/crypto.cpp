@@ -153,6 +153,16 @@ std::vector<uint8_t> Crypto::encrypt_message(const std::string& session_id, cons
     return {};
 }
 
+bool Crypto::encrypt_message(const std::string& session_id, const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+    size_t out_len;
+    uint8_t* encrypted = crypto_encrypt_message(pimpl->mgr, session_id.c_str(), data, len, &out_len);
+    if (encrypted) {
+        out.insert(out.end(), encrypted, encrypted + out_len);
+        return true;
+    }
+    return false;
+}
+
 std::vector<uint8_t> Crypto::decrypt_message(const std::string& session_id, const std::vector<uint8_t>& data) {
     size_t out_len;
     uint8_t* decrypted = crypto_decrypt_message(pimpl->mgr, session_id.c_str(), data.data(), data.size(), &out_len);
@@ -163,6 +173,16 @@ std::vector<uint8_t> Crypto::decrypt_message(const std::string& session_id, cons
     return {};
 }
 
+bool Crypto::decrypt_message(const std::string& session_id, const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+    size_t out_len;
+    uint8_t* decrypted = crypto_decrypt_message(pimpl->mgr, session_id.c_str(), data, len, &out_len);
+    if (decrypted) {
+        out.insert(out.end(), decrypted, decrypted + out_len);
+        return true;
+    }
+    return false;
+}
+
 std::string Crypto::calculate_checksum(const std::vector<uint8_t>& data) {
     char* checksum = crypto_calculate_checksum(pimpl->mgr, data.data(), data.size());
     std::string result(checksum);
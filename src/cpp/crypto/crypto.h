@@ -14,7 +14,11 @@ public:
     std::array<uint8_t, 32> derive_shared_secret(const std::array<uint8_t, 32>& peer_public);
     void set_session_key(const std::string& session_id, const std::array<uint8_t, 32>& key);
     std::vector<uint8_t> encrypt_message(const std::string& session_id, const std::vector<uint8_t>& data);
+    // Appends the ciphertext of data[0, len) to out, avoiding an intermediate copy of the plaintext
+    bool encrypt_message(const std::string& session_id, const uint8_t* data, size_t len, std::vector<uint8_t>& out);
     std::vector<uint8_t> decrypt_message(const std::string& session_id, const std::vector<uint8_t>& data);
+    // Appends the plaintext of data[0, len) to out, so a received frame can be decrypted in place
+    bool decrypt_message(const std::string& session_id, const uint8_t* data, size_t len, std::vector<uint8_t>& out);
     std::string calculate_checksum(const std::vector<uint8_t>& data);
 
     // Secure key storage
@@ -8,6 +8,53 @@
 #include <chrono>
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+
+// Completed-chunk bitmap as alternating run lengths (unset first), each a LEB128
+// varint, so a mostly-done or mostly-empty transfer takes a few bytes
+static std::vector<uint8_t> encode_runs(const std::vector<uint8_t>& bits, uint64_t count) {
+    std::vector<uint8_t> out;
+    auto put_varint = [&out](uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    };
+    bool current = false;
+    uint64_t run = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        bool bit = i / 8 < bits.size() && ((bits[i / 8] >> (i % 8)) & 1);
+        if (bit != current) {
+            put_varint(run);
+            current = bit;
+            run = 0;
+        }
+        ++run;
+    }
+    put_varint(run);
+    return out;
+}
+
+static std::vector<uint8_t> decode_runs(const uint8_t* data, size_t size, uint64_t count) {
+    std::vector<uint8_t> bits((count + 7) / 8, 0);
+    bool current = false;
+    uint64_t index = 0;
+    size_t pos = 0;
+    while (pos < size && index < count) {
+        uint64_t run = 0;
+        for (int shift = 0; pos < size && shift < 64; shift += 7) {
+            uint8_t byte = data[pos++];
+            run |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        for (uint64_t end = std::min(count, index + run); index < end; ++index) {
+            if (current) bits[index / 8] |= 1 << (index % 8);
+        }
+        current = !current;
+    }
+    return bits;
+}
 
 class Database::Impl {
 public:
@@ -55,17 +102,18 @@ public:
                 timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
                 status TEXT DEFAULT 'pending' CHECK (status IN ('pending', 'in_progress', 'complete', 'failed', 'paused'))
             );
-            CREATE TABLE IF NOT EXISTS file_transfer_chunks (
-                transfer_id TEXT NOT NULL,
-                offset BIGINT NOT NULL,
-                checksum INTEGER NOT NULL,
-                sent BOOLEAN DEFAULT 0,
-                retry_count INTEGER DEFAULT 0,
-                PRIMARY KEY (transfer_id, offset)
+            -- Per-chunk resume rows, superseded by transfer_resume
+            DROP TABLE IF EXISTS file_transfer_chunks;
+            CREATE TABLE IF NOT EXISTS transfer_resume (
+                transfer_id TEXT PRIMARY KEY,
+                chunk_size INTEGER NOT NULL,
+                chunk_count INTEGER NOT NULL,
+                completed BLOB NOT NULL,
+                checksums BLOB NOT NULL,
+                updated DATETIME DEFAULT CURRENT_TIMESTAMP
             );
             CREATE INDEX IF NOT EXISTS idx_devices_addr ON devices(bluetooth_address);
             CREATE INDEX IF NOT EXISTS idx_messages_conv ON messages(conversation_id);
-            CREATE INDEX IF NOT EXISTS idx_chunks_transfer ON file_transfer_chunks(transfer_id);
         )";
 
         char* err_msg = nullptr;
@@ -204,6 +252,21 @@ public:
         return success;
     }
 
+    bool update_file_checksum(const std::string& id, const std::string& checksum) {
+        std::string sql = "UPDATE files SET checksum = ? WHERE id = ?;";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            return false;
+        }
+
+        sqlite3_bind_text(stmt, 1, checksum.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, id.c_str(), -1, SQLITE_TRANSIENT);
+
+        bool success = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        return success;
+    }
+
     std::vector<File> get_files() {
         std::vector<File> files;
         std::string sql = "SELECT id, sender_id, receiver_id, filename, size, checksum, path, timestamp, status FROM files ORDER BY timestamp DESC;";
@@ -230,62 +293,74 @@ public:
         return files;
     }
 
-    bool add_transfer_chunk(const FileTransferChunk& chunk) {
-        std::string sql = "INSERT OR REPLACE INTO file_transfer_chunks (transfer_id, offset, checksum, sent, retry_count) VALUES (?, ?, ?, ?, ?);";
+    bool save_resume_state(const TransferResumeState& state) {
+        std::string sql = "INSERT OR REPLACE INTO transfer_resume (transfer_id, chunk_size, chunk_count, completed, checksums, updated) VALUES (?, ?, ?, ?, ?, CURRENT_TIMESTAMP);";
         sqlite3_stmt* stmt;
         if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
             return false;
         }
 
-        sqlite3_bind_text(stmt, 1, chunk.transfer_id.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 2, chunk.offset);
-        sqlite3_bind_int(stmt, 3, chunk.checksum);
-        sqlite3_bind_int(stmt, 4, chunk.sent ? 1 : 0);
-        sqlite3_bind_int(stmt, 5, chunk.retry_count);
+        uint64_t count = state.checksums.size();
+        std::vector<uint8_t> completed = encode_runs(state.completed, count);
+        std::vector<uint8_t> checksums(count * 4);
+        for (uint64_t i = 0; i < count; ++i) {
+            checksums[i * 4] = state.checksums[i] & 0xFF;
+            checksums[i * 4 + 1] = (state.checksums[i] >> 8) & 0xFF;
+            checksums[i * 4 + 2] = (state.checksums[i] >> 16) & 0xFF;
+            checksums[i * 4 + 3] = (state.checksums[i] >> 24) & 0xFF;
+        }
+        sqlite3_bind_text(stmt, 1, state.transfer_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, state.chunk_size);
+        sqlite3_bind_int64(stmt, 3, count);
+        sqlite3_bind_blob(stmt, 4, completed.data(), completed.size(), SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 5, checksums.data(), checksums.size(), SQLITE_STATIC);
 
         bool success = sqlite3_step(stmt) == SQLITE_DONE;
         sqlite3_finalize(stmt);
         return success;
     }
 
-    bool update_chunk_sent(const std::string& transfer_id, uint64_t offset, bool sent) {
-        std::string sql = "UPDATE file_transfer_chunks SET sent = ? WHERE transfer_id = ? AND offset = ?;";
+    bool get_resume_state(const std::string& transfer_id, TransferResumeState& state) {
+        std::string sql = "SELECT chunk_size, chunk_count, completed, checksums FROM transfer_resume WHERE transfer_id = ?;";
         sqlite3_stmt* stmt;
         if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
             return false;
         }
 
-        sqlite3_bind_int(stmt, 1, sent ? 1 : 0);
-        sqlite3_bind_text(stmt, 2, transfer_id.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 3, offset);
+        sqlite3_bind_text(stmt, 1, transfer_id.c_str(), -1, SQLITE_TRANSIENT);
+
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        if (found) {
+            state.transfer_id = transfer_id;
+            state.chunk_size = sqlite3_column_int64(stmt, 0);
+            uint64_t count = sqlite3_column_int64(stmt, 1);
+            const uint8_t* completed = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 2));
+            state.completed = decode_runs(completed, sqlite3_column_bytes(stmt, 2), count);
+            const uint8_t* checksums = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 3));
+            size_t checksum_bytes = sqlite3_column_bytes(stmt, 3);
+            state.checksums.assign(count, 0);
+            for (uint64_t i = 0; i < count && (i + 1) * 4 <= checksum_bytes; ++i) {
+                state.checksums[i] = uint32_t(checksums[i * 4]) | (uint32_t(checksums[i * 4 + 1]) << 8) |
+                                     (uint32_t(checksums[i * 4 + 2]) << 16) | (uint32_t(checksums[i * 4 + 3]) << 24);
+            }
+        }
 
-        bool success = sqlite3_step(stmt) == SQLITE_DONE;
         sqlite3_finalize(stmt);
-        return success;
+        return found;
     }
 
-    std::vector<FileTransferChunk> get_transfer_chunks(const std::string& transfer_id) {
-        std::vector<FileTransferChunk> chunks;
-        std::string sql = "SELECT transfer_id, offset, checksum, sent, retry_count FROM file_transfer_chunks WHERE transfer_id = ? ORDER BY offset ASC;";
+    bool delete_resume_state(const std::string& transfer_id) {
+        std::string sql = "DELETE FROM transfer_resume WHERE transfer_id = ?;";
         sqlite3_stmt* stmt;
         if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            return chunks;
+            return false;
         }
 
         sqlite3_bind_text(stmt, 1, transfer_id.c_str(), -1, SQLITE_TRANSIENT);
 
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            FileTransferChunk chunk;
-            chunk.transfer_id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-            chunk.offset = sqlite3_column_int64(stmt, 1);
-            chunk.checksum = sqlite3_column_int(stmt, 2);
-            chunk.sent = sqlite3_column_int(stmt, 3) != 0;
-            chunk.retry_count = sqlite3_column_int(stmt, 4);
-            chunks.push_back(chunk);
-        }
-
+        bool success = sqlite3_step(stmt) == SQLITE_DONE;
         sqlite3_finalize(stmt);
-        return chunks;
+        return success;
     }
 };
 
@@ -322,22 +397,27 @@ bool Database::update_file_status(const std::string& id, const std::string& stat
     return pimpl->update_file_status(id, status);
 }
 
+bool Database::update_file_checksum(const std::string& id, const std::string& checksum) {
+    std::lock_guard<std::mutex> lock(pimpl->mtx);
+    return pimpl->update_file_checksum(id, checksum);
+}
+
 std::vector<File> Database::get_files() {
     std::lock_guard<std::mutex> lock(pimpl->mtx);
     return pimpl->get_files();
 }
 
-bool Database::add_transfer_chunk(const FileTransferChunk& chunk) {
+bool Database::save_resume_state(const TransferResumeState& state) {
     std::lock_guard<std::mutex> lock(pimpl->mtx);
-    return pimpl->add_transfer_chunk(chunk);
+    return pimpl->save_resume_state(state);
 }
 
-bool Database::update_chunk_sent(const std::string& transfer_id, uint64_t offset, bool sent) {
+bool Database::get_resume_state(const std::string& transfer_id, TransferResumeState& state) {
     std::lock_guard<std::mutex> lock(pimpl->mtx);
-    return pimpl->update_chunk_sent(transfer_id, offset, sent);
+    return pimpl->get_resume_state(transfer_id, state);
 }
 
-std::vector<FileTransferChunk> Database::get_transfer_chunks(const std::string& transfer_id) {
+bool Database::delete_resume_state(const std::string& transfer_id) {
     std::lock_guard<std::mutex> lock(pimpl->mtx);
-    return pimpl->get_transfer_chunks(transfer_id);
+    return pimpl->delete_resume_state(transfer_id);
 }
\ No newline at end of file
@@ -34,12 +34,12 @@ struct File {
     std::string status;
 };
 
-struct FileTransferChunk {
+// Resume state for one transfer, stored as a single row
+struct TransferResumeState {
     std::string transfer_id;
-    uint64_t offset;
-    uint32_t checksum;
-    bool sent;
-    int retry_count;
+    uint64_t chunk_size;
+    std::vector<uint8_t> completed; // One bit per chunk, LSB first
+    std::vector<uint32_t> checksums; // CRC32 per chunk; its size is the chunk count
 };
 
 class Database {
@@ -55,11 +55,12 @@ public:
 
     bool add_file(const File& file);
     bool update_file_status(const std::string& id, const std::string& status);
+    bool update_file_checksum(const std::string& id, const std::string& checksum);
     std::vector<File> get_files();
 
-    bool add_transfer_chunk(const FileTransferChunk& chunk);
-    bool update_chunk_sent(const std::string& transfer_id, uint64_t offset, bool sent);
-    std::vector<FileTransferChunk> get_transfer_chunks(const std::string& transfer_id);
+    bool save_resume_state(const TransferResumeState& state);
+    bool get_resume_state(const std::string& transfer_id, TransferResumeState& state);
+    bool delete_resume_state(const std::string& transfer_id);
 
 private:
     class Impl;
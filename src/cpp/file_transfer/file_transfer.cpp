@@ -12,25 +12,417 @@
 #include <unordered_set>
 #include <chrono>
 #include <cstring>
+#include <atomic>
+#include <algorithm>
 #include <openssl/sha.h>
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
 
+// Reads chunks of an outgoing file on demand. On POSIX systems the file is
+// memory-mapped so chunks are encrypted straight from the page cache; elsewhere,
+// or if mapping fails, it falls back to buffered reads.
+class ChunkSource {
+public:
+    explicit ChunkSource(const std::string& path) {
+#if !defined(_WIN32)
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    mapping = static_cast<const uint8_t*>(addr);
+                    mapping_size = st.st_size;
+                    madvise(addr, mapping_size, MADV_SEQUENTIAL);
+                    return;
+                }
+            }
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        file.open(path, std::ios::binary);
+    }
+
+    ~ChunkSource() {
+#if !defined(_WIN32)
+        if (mapping) munmap(const_cast<uint8_t*>(mapping), mapping_size);
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+
+    ChunkSource(const ChunkSource&) = delete;
+    ChunkSource& operator=(const ChunkSource&) = delete;
+
+    bool is_open() const { return mapping || file.is_open(); }
+
+    // Returns a pointer into the mapping, or nullptr if the source is not mapped
+    const uint8_t* view(uint64_t offset, uint64_t length) const {
+        if (!mapping || offset + length > mapping_size) return nullptr;
+        return mapping + offset;
+    }
+
+    bool read(uint64_t offset, uint64_t length, std::vector<uint8_t>& out) {
+        out.resize(length);
+        file.clear();
+        file.seekg(offset);
+        file.read(reinterpret_cast<char*>(out.data()), length);
+        return static_cast<uint64_t>(file.gcount()) == length;
+    }
+
+    // Drop the pages of an acknowledged chunk so a multi-GB send doesn't grow the resident set
+    void release(uint64_t offset, uint64_t length) {
+#if !defined(_WIN32)
+        if (!mapping || offset >= mapping_size) return;
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset / page * page;
+        uint64_t end = std::min(offset + length, mapping_size);
+        madvise(const_cast<uint8_t*>(mapping) + start, end - start, MADV_DONTNEED);
+#if defined(__linux__)
+        posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
+private:
+    std::ifstream file;
+    const uint8_t* mapping = nullptr;
+    uint64_t mapping_size = 0;
+#if !defined(_WIN32)
+    int fd = -1;
+#endif
+};
+
+// Destination of an incoming file. Chunks land at their own offset with pwrite
+// into a file preallocated to its final size, so arrival order doesn't matter
+// and a resumed transfer keeps what is already on disk.
+class ChunkSink {
+public:
+    ChunkSink(const std::string& path, uint64_t size, bool keep_existing) {
+#if !defined(_WIN32)
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (keep_existing ? 0 : O_TRUNC), 0644);
+        if (fd >= 0 && size > 0) {
+#if defined(__linux__)
+            if (fallocate(fd, 0, 0, size) != 0) {
+                if (ftruncate(fd, size) != 0) { /* Chunks still extend the file as they land */ }
+            }
+#else
+            if (ftruncate(fd, size) != 0) { /* Chunks still extend the file as they land */ }
+#endif
+        }
+#else
+        (void)size;
+        if (!keep_existing || !std::filesystem::exists(path)) {
+            std::ofstream(path, std::ios::binary | std::ios::trunc);
+        }
+        file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+#endif
+    }
+
+    ~ChunkSink() { close(); }
+
+    ChunkSink(const ChunkSink&) = delete;
+    ChunkSink& operator=(const ChunkSink&) = delete;
+
+    bool is_open() const {
+#if !defined(_WIN32)
+        return fd >= 0;
+#else
+        return file.is_open();
+#endif
+    }
+
+    bool write(uint64_t offset, const uint8_t* data, size_t length) {
+#if !defined(_WIN32)
+        while (length > 0) {
+            ssize_t written = pwrite(fd, data, length, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            offset += written;
+            length -= written;
+        }
+        return true;
+#else
+        file.seekp(offset);
+        file.write(reinterpret_cast<const char*>(data), length);
+        return static_cast<bool>(file);
+#endif
+    }
+
+    bool read(uint64_t offset, uint64_t length, std::vector<uint8_t>& out) {
+        out.resize(length);
+#if !defined(_WIN32)
+        uint8_t* data = out.data();
+        while (length > 0) {
+            ssize_t got = pread(fd, data, length, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            data += got;
+            offset += got;
+            length -= got;
+        }
+        return true;
+#else
+        file.seekg(offset);
+        file.read(reinterpret_cast<char*>(out.data()), length);
+        return static_cast<uint64_t>(file.gcount()) == length;
+#endif
+    }
+
+    void close() {
+#if !defined(_WIN32)
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+#else
+        file.close();
+#endif
+    }
+
+private:
+#if !defined(_WIN32)
+    int fd = -1;
+#else
+    std::fstream file;
+#endif
+};
+
+// Incremental SHA-256 fed in file order, so the whole-file digest is ready as
+// soon as the last chunk has been read instead of needing a separate pass
+class StreamHasher {
+public:
+    StreamHasher() { SHA256_Init(&ctx); }
+
+    uint64_t bytes_hashed() const { return hashed; }
+
+    void update(const uint8_t* data, size_t length) {
+        SHA256_Update(&ctx, data, length);
+        hashed += length;
+    }
+
+    std::string hex_digest() {
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        SHA256_Final(hash, &ctx);
+
+        std::stringstream ss;
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+            ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+        }
+        return ss.str();
+    }
+
+private:
+    SHA256_CTX ctx;
+    uint64_t hashed = 0;
+};
+
+using ChunkHash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+static ChunkHash hash_chunk(const uint8_t* data, size_t length) {
+    ChunkHash leaf;
+    SHA256(data, length, leaf.data());
+    return leaf;
+}
+
+// Root of the binary Merkle tree over the chunk hashes. Interior nodes hash a
+// 0x01 prefix so they can't collide with a leaf; an unpaired node moves up as is.
+static std::vector<uint8_t> merkle_root(std::vector<ChunkHash> level) {
+    if (level.empty()) return {};
+    while (level.size() > 1) {
+        std::vector<ChunkHash> parents((level.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                parents[i / 2] = level[i];
+                continue;
+            }
+            uint8_t node[1 + 2 * SHA256_DIGEST_LENGTH];
+            node[0] = 0x01;
+            std::memcpy(node + 1, level[i].data(), SHA256_DIGEST_LENGTH);
+            std::memcpy(node + 1 + SHA256_DIGEST_LENGTH, level[i + 1].data(), SHA256_DIGEST_LENGTH);
+            SHA256(node, sizeof(node), parents[i / 2].data());
+        }
+        level = std::move(parents);
+    }
+    return std::vector<uint8_t>(level[0].begin(), level[0].end());
+}
+
+// Byte budget refilled at a fixed rate, holding at most BURST_MS worth. A send
+// may overdraw it; the next one waits until the balance is back to zero. A rate
+// of 0 means unlimited.
+class TokenBucket {
+public:
+    static constexpr int BURST_MS = 100;
+
+    void set_rate(uint64_t bytes_per_second, std::chrono::steady_clock::time_point now) {
+        refill(now);
+        rate = bytes_per_second;
+        burst = static_cast<double>(rate) * BURST_MS / 1000;
+        tokens = std::min(tokens, burst);
+    }
+
+    std::chrono::steady_clock::time_point ready_at(std::chrono::steady_clock::time_point now) {
+        if (rate == 0) return now;
+        refill(now);
+        if (tokens >= 0) return now;
+        return now + std::chrono::microseconds(static_cast<int64_t>(-tokens * 1000000 / rate) + 1);
+    }
+
+    void consume(uint64_t bytes, std::chrono::steady_clock::time_point now) {
+        if (rate == 0) return;
+        refill(now);
+        tokens -= static_cast<double>(bytes);
+    }
+
+private:
+    void refill(std::chrono::steady_clock::time_point now) {
+        if (rate && now > last) {
+            tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+        }
+        last = now;
+    }
+
+    uint64_t rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+};
+
+// Resume state for one transfer, kept in memory and written back as one row
+struct ResumeRecord {
+    TransferResumeState state;
+    size_t unsaved = 0; // Chunks completed since the last write
+    std::chrono::steady_clock::time_point flushed = std::chrono::steady_clock::now();
+
+    void reset(const std::string& transfer_id, uint64_t chunk_size, uint64_t chunk_count) {
+        state.transfer_id = transfer_id;
+        state.chunk_size = chunk_size;
+        state.completed.assign((chunk_count + 7) / 8, 0);
+        state.checksums.assign(chunk_count, 0);
+        unsaved = 0;
+    }
+
+    // Saved state is only usable if it was chunked the same way
+    bool matches(uint64_t chunk_size, uint64_t chunk_count) const {
+        return state.chunk_size == chunk_size && state.checksums.size() == chunk_count &&
+               state.completed.size() == (chunk_count + 7) / 8;
+    }
+
+    bool completed(uint64_t index) const {
+        return index < state.checksums.size() && ((state.completed[index / 8] >> (index % 8)) & 1);
+    }
+
+    void complete(uint64_t index) {
+        if (index >= state.checksums.size() || completed(index)) return;
+        state.completed[index / 8] |= 1 << (index % 8);
+        ++unsaved;
+    }
+
+    void clear(uint64_t index) {
+        if (index < state.checksums.size()) state.completed[index / 8] &= ~(1 << (index % 8));
+    }
+};
+
+// One bit per chunk of a transfer. The gap-free prefix is kept up to date so
+// SACKs and completion checks don't need to scan the whole map.
+class ChunkBitmap {
+public:
+    void resize(uint64_t chunk_count) {
+        count = chunk_count;
+        bits.resize((chunk_count + 7) / 8, 0);
+    }
+
+    uint64_t size() const { return count; }
+
+    bool test(uint64_t index) const {
+        return index < count && ((bits[index / 8] >> (index % 8)) & 1);
+    }
+
+    // Returns false if the chunk is out of range or was already marked
+    bool set(uint64_t index) {
+        if (index >= count || test(index)) return false;
+        bits[index / 8] |= 1 << (index % 8);
+        ++marked;
+        highest = std::max(highest, index + 1);
+        while (prefix < count && test(prefix)) ++prefix;
+        return true;
+    }
+
+    void unset(uint64_t index) {
+        if (!test(index)) return;
+        bits[index / 8] &= ~(1 << (index % 8));
+        --marked;
+        prefix = std::min(prefix, index);
+    }
+
+    uint64_t contiguous() const { return prefix; } // Chunks received with no gap from the start
+    uint64_t end() const { return highest; } // One past the highest marked chunk
+    bool complete() const { return marked == count; }
+
+private:
+    std::vector<uint8_t> bits;
+    uint64_t count = 0;
+    uint64_t marked = 0;
+    uint64_t prefix = 0;
+    uint64_t highest = 0;
+};
+
 class FileTransfer::Impl {
 public:
     std::unordered_map<std::string, TransferSession> active_transfers;
     std::mutex transfer_mutex;
-    std::queue<std::string> transfer_queue; // FIFO queue for file IDs
-    std::mutex queue_mutex;
-    std::condition_variable queue_cv;
+    std::condition_variable transfer_cv; // Signalled on SACKs, pause/resume and shutdown
+    std::atomic<uint32_t> next_connection_id{1};
+    std::unordered_map<std::string, std::deque<std::string>> peer_sessions; // DRR ring of file IDs per receiver
+    std::deque<std::string> peer_order; // Receivers with sessions, in service order
+    std::unordered_set<std::string> busy_peers; // Receivers a worker is sending to
+    std::vector<std::thread> workers;
+    std::unordered_map<std::string, ResumeRecord> sending_resume; // Guarded by transfer_mutex
+    TokenBucket global_bucket; // All outgoing file data
+    std::unordered_map<std::string, TokenBucket> peer_buckets; // Per receiver, only where a limit is set
     bool stop_processing = false;
     std::function<bool(const std::string& device_id, const std::vector<uint8_t>& data)> data_sender;
-    std::unordered_map<std::string, std::ofstream> receiving_files;
+    std::function<bool(const std::string& device_id)> link_writable;
+    std::unordered_map<std::string, std::unique_ptr<ChunkSink>> receiving_files;
     std::unordered_map<std::string, uint64_t> received_bytes;
     std::unordered_map<std::string, std::string> receiving_checksums;
     std::unordered_map<std::string, std::string> receiving_paths;
     std::unordered_map<std::string, uint64_t> receiving_sizes;
     std::unordered_map<std::string, CompletionCallback> receiving_completion;
     std::unordered_map<std::string, ProgressCallback> receiving_progress;
+    std::unordered_map<std::string, ChunkBitmap> receiving_chunks;
+    std::unordered_map<std::string, uint32_t> receiving_connection_ids;
+    std::map<std::pair<std::string, uint32_t>, std::string> receiving_by_connection; // (sender, connection id) -> file ID
+    std::unordered_map<std::string, int> receiving_unacked;
+    std::unordered_map<std::string, std::unique_ptr<StreamHasher>> receiving_hashers;
+    std::unordered_map<std::string, std::map<uint64_t, std::vector<uint8_t>>> receiving_pending; // Landed ahead of the digest
+    std::unordered_map<std::string, std::vector<ChunkHash>> receiving_leaves; // Verified chunk hashes by index
+    std::unordered_map<std::string, std::vector<uint8_t>> receiving_roots; // Merkle root from the sender's trailer
+    std::unordered_map<std::string, ResumeRecord> receiving_resume; // Guarded by receive_mutex
+    std::unordered_set<std::string> receiving_ended; // Final chunk and its trailer arrived in this attempt
+    ReceivedFileCallback received_file_callback;
+
+    // One decoded chunk packet
+    struct IncomingChunk {
+        uint64_t offset = 0;
+        std::vector<uint8_t> body;
+        std::vector<uint8_t> hash; // Sender's SHA-256 of the body
+        std::string checksum; // Trailer: whole-file SHA-256
+        std::vector<uint8_t> merkle_root; // Trailer: root over all chunk hashes
+        bool end_of_body = false;
+    };
     std::string current_file_id;
     IncomingFileCallback incoming_file_callback;
     std::mutex receive_mutex;
@@ -38,6 +430,19 @@ public:
     std::string generate_id() {
         return "id_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
     }
+
+    // The same unchanged file sent to the same peer gets the same id, so an
+    // interrupted send finds its saved resume state when it is sent again
+    static std::string transfer_key(const std::filesystem::path& path, uint64_t size, const std::string& receiver_id) {
+        std::error_code error;
+        auto modified = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        auto canonical = std::filesystem::weakly_canonical(path, error);
+        if (error) canonical = path;
+        std::string key = canonical.string() + '\n' + std::to_string(size) + '\n' + std::to_string(modified) + '\n' + receiver_id;
+        StreamHasher hasher;
+        hasher.update(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+        return "tx_" + hasher.hex_digest().substr(0, 32);
+    }
     Crypto& crypto;
     Database& database;
 
@@ -62,31 +467,138 @@ public:
         return crc ^ 0xFFFFFFFF;
     }
 
-    std::vector<uint8_t> create_chunk_packet(const FileChunk& chunk, bool is_final, const std::string& session_id) {
-        std::vector<uint8_t> packet;
-        std::vector<uint8_t> headers;
+    void append_u32_header(std::vector<uint8_t>& out, OBEXHeaderId hi, uint32_t value) {
+        out.push_back(static_cast<uint8_t>(hi));
+        out.push_back((value >> 24) & 0xFF);
+        out.push_back((value >> 16) & 0xFF);
+        out.push_back((value >> 8) & 0xFF);
+        out.push_back(value & 0xFF);
+    }
+
+    void append_bytes_header(std::vector<uint8_t>& out, OBEXHeaderId hi, const uint8_t* data, size_t length) {
+        uint16_t header_len = 3 + length;
+        out.push_back(static_cast<uint8_t>(hi));
+        out.push_back(header_len >> 8);
+        out.push_back(header_len & 0xFF);
+        out.insert(out.end(), data, data + length);
+    }
 
-        // Encrypt data
-        auto encrypted_data = crypto.encrypt_message(session_id, chunk.data);
+    uint32_t read_u32(const uint8_t* data) {
+        return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+    }
+
+    void append_encrypted_header(std::vector<uint8_t>& out, OBEXHeaderId hi, const std::string& session_id,
+                                 const uint8_t* data, size_t length) {
+        size_t header_offset = out.size();
+        out.resize(header_offset + 3);
+        crypto.encrypt_message(session_id, data, length, out);
+        uint16_t header_len = out.size() - header_offset;
+        out[header_offset] = static_cast<uint8_t>(hi);
+        out[header_offset + 1] = header_len >> 8;
+        out[header_offset + 2] = header_len & 0xFF;
+    }
+
+    // session supplies the connection id and, on the final chunk, the trailer
+    std::vector<uint8_t> create_chunk_packet(const FileChunk& chunk, bool is_final, const std::string& session_id,
+                                             const TransferSession* session = nullptr) {
+        std::vector<uint8_t> packet(sizeof(OBEXHeader));
+        if (session && session->connection_id) {
+            append_u32_header(packet, OBEXHeaderId::CONNECTION, session->connection_id);
+        }
+        append_u32_header(packet, OBEXHeaderId::CHUNK_OFFSET, chunk.offset);
+        if (session) {
+            append_encrypted_header(packet, OBEXHeaderId::CHUNK_HASH, session_id, chunk.hash.data(), chunk.hash.size());
+        }
+
+        // Whole-file digest and Merkle root ride in front of END_OF_BODY so they never need a pre-read
+        if (is_final && session && !session->checksum.empty()) {
+            append_encrypted_header(packet, OBEXHeaderId::CHECKSUM, session_id,
+                                    reinterpret_cast<const uint8_t*>(session->checksum.data()), session->checksum.size());
+        }
+        if (is_final && session && !session->merkle_root.empty()) {
+            append_encrypted_header(packet, OBEXHeaderId::MERKLE_ROOT, session_id, session->merkle_root.data(), session->merkle_root.size());
+        }
+
+        // Build the body in place: body header first, then the ciphertext
+        // appended straight from the chunk bytes
+        size_t body_offset = packet.size();
+        packet.resize(body_offset + 3);
+        packet.reserve(packet.size() + chunk.length + 64); // Room for nonce and tag
+        crypto.encrypt_message(session_id, chunk.bytes(), chunk.length, packet);
 
         // Body or End-of-Body
         uint8_t body_hi = is_final ? static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY) : static_cast<uint8_t>(OBEXHeaderId::BODY);
-        uint16_t body_len = 3 + encrypted_data.size();
-        headers.push_back(body_hi);
-        headers.push_back(body_len >> 8);
-        headers.push_back(body_len & 0xFF);
-        headers.insert(headers.end(), encrypted_data.begin(), encrypted_data.end());
+        uint16_t body_len = packet.size() - body_offset;
+        packet[body_offset] = body_hi;
+        packet[body_offset + 1] = body_len >> 8;
+        packet[body_offset + 2] = body_len & 0xFF;
 
         OBEXHeader obex_header;
         obex_header.opcode = static_cast<uint8_t>(OBEXOpcode::PUT);
-        obex_header.length = sizeof(OBEXHeader) + headers.size();
+        obex_header.length = packet.size();
+        std::memcpy(packet.data(), &obex_header, sizeof(obex_header));
+
+        return packet;
+    }
+
+    // Receiver-side acknowledgement: everything below contiguous() plus a bitmap
+    // of the chunks that arrived past the first gap. Holes below the highest set
+    // bit act as NACKs.
+    std::vector<uint8_t> create_sack_packet(uint32_t connection_id, const ChunkBitmap& received) {
+        std::vector<uint8_t> packet(sizeof(OBEXHeader));
+        if (connection_id) {
+            append_u32_header(packet, OBEXHeaderId::CONNECTION, connection_id);
+        }
 
-        packet.insert(packet.end(), reinterpret_cast<uint8_t*>(&obex_header), reinterpret_cast<uint8_t*>(&obex_header) + sizeof(obex_header));
-        packet.insert(packet.end(), headers.begin(), headers.end());
+        uint64_t base = received.contiguous();
+        uint64_t bitmap_end = std::min<uint64_t>(received.end(), base + 1 + SACK_BITMAP_CHUNKS);
+        std::vector<uint8_t> bitmap(bitmap_end > base + 1 ? (bitmap_end - base - 1 + 7) / 8 : 0, 0);
+        for (uint64_t index = base + 1; index < bitmap_end; ++index) {
+            if (received.test(index)) {
+                uint64_t bit = index - base - 1;
+                bitmap[bit / 8] |= 1 << (bit % 8);
+            }
+        }
 
+        uint16_t sack_len = 3 + 4 + bitmap.size();
+        packet.push_back(static_cast<uint8_t>(OBEXHeaderId::SACK));
+        packet.push_back(sack_len >> 8);
+        packet.push_back(sack_len & 0xFF);
+        packet.push_back((base >> 24) & 0xFF);
+        packet.push_back((base >> 16) & 0xFF);
+        packet.push_back((base >> 8) & 0xFF);
+        packet.push_back(base & 0xFF);
+        packet.insert(packet.end(), bitmap.begin(), bitmap.end());
+
+        OBEXHeader obex_header;
+        obex_header.opcode = static_cast<uint8_t>(received.complete() ? OBEXOpcode::SUCCESS : OBEXOpcode::CONTINUE);
+        obex_header.length = packet.size();
+        std::memcpy(packet.data(), &obex_header, sizeof(obex_header));
         return packet;
     }
 
+    // Reads the next OBEX header; the top two bits of the HI select its encoding
+    bool next_header(const std::vector<uint8_t>& headers, size_t& offset, uint8_t& hi, std::vector<uint8_t>& value) {
+        if (offset >= headers.size()) return false;
+        hi = headers[offset++];
+        size_t len;
+        switch (hi & 0xC0) {
+            case 0x80: len = 1; break; // 1-byte quantity
+            case 0xC0: len = 4; break; // 4-byte quantity
+            default: // Length-prefixed unicode or byte sequence
+                if (offset + 2 > headers.size()) return false;
+                len = (headers[offset] << 8) | headers[offset + 1];
+                if (len < 3) return false;
+                len -= 3;
+                offset += 2;
+                break;
+        }
+        if (offset + len > headers.size()) return false;
+        value.assign(headers.begin() + offset, headers.begin() + offset + len);
+        offset += len;
+        return true;
+    }
+
     std::vector<uint8_t> encode_unicode(const std::string& str) {
         std::vector<uint8_t> result;
         for (char c : str) {
@@ -108,131 +620,541 @@ public:
         return result;
     }
 
-    std::string sha256_file(const std::string& path) {
-        std::ifstream file(path, std::ios::binary);
-        if (!file) return "";
+    // Top up the session's read-ahead window so memory stays bounded regardless of file size
+    bool fill_read_ahead(TransferSession& session) {
+        while (session.chunk_queue.size() < READ_AHEAD_CHUNKS && session.next_offset < session.file_size) {
+            uint64_t offset = session.next_offset;
+            uint64_t chunk_size = std::min(SEND_CHUNK_SIZE, session.file_size - offset);
+            session.next_offset += chunk_size;
+            if (!session.source) return false;
+
+            // The final chunk is always sent, as it carries the digest and Merkle root trailer
+            bool is_final = offset + chunk_size >= session.file_size;
+            if (!is_final && session.sent_offsets.find(offset) != session.sent_offsets.end()) {
+                // Already sent before resume, but the digest and Merkle leaves still need its bytes
+                std::vector<uint8_t> skipped;
+                const uint8_t* view = session.source->view(offset, chunk_size);
+                if (!view) {
+                    if (!session.source->read(offset, chunk_size, skipped)) return false;
+                    view = skipped.data();
+                }
+                session.chunk_hashes[offset / SEND_CHUNK_SIZE] = hash_chunk(view, chunk_size);
+                if (session.hasher && session.hasher->bytes_hashed() == offset) {
+                    session.hasher->update(view, chunk_size);
+                }
+                continue;
+            }
 
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
+            FileChunk chunk;
+            chunk.file_id = session.file_id;
+            chunk.offset = offset;
+            chunk.length = chunk_size;
+            chunk.view = session.source->view(offset, chunk_size);
+            if (!chunk.view && !session.source->read(offset, chunk_size, chunk.data)) {
+                return false;
+            }
+            chunk.checksum = crc32(chunk.bytes(), chunk.length);
+            chunk.hash = hash_chunk(chunk.bytes(), chunk.length);
+            session.chunk_hashes[offset / SEND_CHUNK_SIZE] = chunk.hash;
+            chunk.retry_count = 0;
+            if (session.hasher && session.hasher->bytes_hashed() == offset) {
+                session.hasher->update(chunk.bytes(), chunk.length);
+            }
 
-        char buffer[8192];
-        while (file.read(buffer, sizeof(buffer))) {
-            SHA256_Update(&sha256, buffer, file.gcount());
+            sending_resume[session.file_id].state.checksums[offset / SEND_CHUNK_SIZE] = chunk.checksum;
+            session.chunk_queue.push(std::move(chunk));
         }
-        SHA256_Update(&sha256, buffer, file.gcount());
+        return true;
+    }
 
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_Final(hash, &sha256);
+    // Resume state is written back every DB_FLUSH_CHUNKS completed chunks or
+    // DB_FLUSH_MS, and always when forced. A crash loses at most that much
+    // progress, which is simply sent again.
+    void flush_resume_state(std::unordered_map<std::string, ResumeRecord>& records, const std::string& file_id, bool force) {
+        auto it = records.find(file_id);
+        if (it == records.end() || it->second.unsaved == 0) return;
+        ResumeRecord& record = it->second;
+        auto now = std::chrono::steady_clock::now();
+        if (!force && record.unsaved < DB_FLUSH_CHUNKS && now - record.flushed < std::chrono::milliseconds(DB_FLUSH_MS)) {
+            return;
+        }
+        database.save_resume_state(record.state);
+        record.unsaved = 0;
+        record.flushed = now;
+    }
 
-        std::stringstream ss;
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-            ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    void fail_session(TransferSession& session) {
+        session.active = false;
+        session.chunk_queue = {}; // Chunks may point into the source's mapping
+        session.in_flight.clear();
+        session.retransmit_queue.clear();
+        session.source.reset();
+        flush_resume_state(sending_resume, session.file_id, true);
+        sending_resume.erase(session.file_id);
+        database.update_file_status(session.file_id, "failed");
+    }
+
+    void queue_retransmit(TransferSession& session, uint64_t offset, bool urgent) {
+        if (std::find(session.retransmit_queue.begin(), session.retransmit_queue.end(), offset) != session.retransmit_queue.end()) return;
+        if (urgent) {
+            session.retransmit_queue.push_front(offset);
+        } else {
+            session.retransmit_queue.push_back(offset);
         }
-        return ss.str();
     }
 
-    std::vector<FileChunk> create_chunks(const std::string& file_path, const std::string& file_id) {
-        std::vector<FileChunk> chunks;
-        std::ifstream file(file_path, std::ios::binary | std::ios::ate);
-        if (!file) return chunks;
+    enum class SendStep { SENT, IDLE, COMPLETE, FAILED };
 
-        uint64_t file_size = file.tellg();
-        file.seekg(0);
+    // A session has work for a worker: a chunk to (re)send, or nothing left in flight
+    bool can_send(const TransferSession& session, std::chrono::steady_clock::time_point now) {
+        if (!session.active || session.paused || now < session.resume_at) return false;
+        if (!session.retransmit_queue.empty()) return true;
+        for (const auto& entry : session.in_flight) {
+            if (now - entry.second.sent_at >= std::chrono::milliseconds(ACK_TIMEOUT_MS)) return true;
+        }
+        if (session.in_flight.size() < WINDOW_CHUNKS && (!session.chunk_queue.empty() || session.next_offset < session.file_size)) return true;
+        return session.in_flight.empty();
+    }
 
-        uint64_t offset = 0;
-        const uint64_t SMALL_CHUNK_SIZE = 65536; // Reduce chunk size for low power devices
-        while (offset < file_size) {
-            uint64_t chunk_size = std::min(SMALL_CHUNK_SIZE, file_size - offset);
-            std::vector<uint8_t> data(chunk_size);
-            file.read(reinterpret_cast<char*>(data.data()), chunk_size);
+    // When a blocked session can next make progress: end of a link backoff or the oldest ACK timeout
+    bool next_deadline(const TransferSession& session, std::chrono::steady_clock::time_point& deadline) {
+        if (!session.active || session.paused) return false;
+        auto now = std::chrono::steady_clock::now();
+        if (session.resume_at > now) {
+            deadline = session.resume_at;
+            return true;
+        }
+        if (session.in_flight.empty()) return false;
+        deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& entry : session.in_flight) {
+            deadline = std::min(deadline, entry.second.sent_at + std::chrono::milliseconds(ACK_TIMEOUT_MS));
+        }
+        return true;
+    }
 
-            FileChunk chunk;
-            chunk.file_id = file_id;
-            chunk.offset = offset;
-            chunk.data = std::move(data);
-            chunk.checksum = crc32(chunk.data.data(), chunk.data.size());
-            chunk.retry_count = 0;
+    // Sends one chunk of a session keeping up to WINDOW_CHUNKS unacknowledged chunks
+    // in flight. SACKs retire chunks through handle_sack; only NACKed or timed-out
+    // chunks are sent again. Drops the lock around data_sender.
+    SendStep send_next(TransferSession& session, std::unique_lock<std::mutex>& lock, uint64_t& sent_length, std::string& error) {
+        auto now = std::chrono::steady_clock::now();
+        for (const auto& entry : session.in_flight) {
+            if (now - entry.second.sent_at >= std::chrono::milliseconds(ACK_TIMEOUT_MS)) {
+                queue_retransmit(session, entry.first, false);
+            }
+        }
 
-            chunks.push_back(std::move(chunk));
-            offset += chunk_size;
-            std::this_thread::sleep_for(std::chrono::milliseconds(1)); // Yield CPU during chunking
+        FileChunk* chunk = nullptr;
+        while (!chunk) {
+            if (!session.retransmit_queue.empty()) {
+                auto in = session.in_flight.find(session.retransmit_queue.front());
+                session.retransmit_queue.pop_front();
+                if (in == session.in_flight.end()) continue; // Acknowledged in the meantime
+                if (in->second.retry_count >= MAX_RETRIES) {
+                    error = "Transfer failed after max retries";
+                    fail_session(session);
+                    return SendStep::FAILED;
+                }
+                in->second.retry_count++;
+                chunk = &in->second;
+            } else if (session.in_flight.size() < WINDOW_CHUNKS && (!session.chunk_queue.empty() || session.next_offset < session.file_size)) {
+                if (!fill_read_ahead(session)) {
+                    error = "Failed to read file";
+                    fail_session(session);
+                    return SendStep::FAILED;
+                }
+                if (session.chunk_queue.empty()) continue; // Remaining chunks were sent before resume
+                FileChunk next = std::move(session.chunk_queue.front());
+                session.chunk_queue.pop();
+                uint64_t offset = next.offset;
+                chunk = &session.in_flight.emplace(offset, std::move(next)).first->second;
+            } else if (session.in_flight.empty()) {
+                return SendStep::COMPLETE;
+            } else {
+                return SendStep::IDLE; // Window full
+            }
         }
 
-        return chunks;
+        uint64_t offset = chunk->offset;
+        sent_length = chunk->length;
+        bool is_final = offset + chunk->length >= session.file_size;
+        if (is_final && session.checksum.empty() && session.hasher) {
+            // Every byte has been through the producer by now
+            session.checksum = session.hasher->hex_digest();
+            session.merkle_root = merkle_root(session.chunk_hashes);
+            database.update_file_checksum(session.file_id, session.checksum);
+        }
+        chunk->sent_at = std::chrono::steady_clock::now();
+        chunk->send_sequence = session.next_send_sequence++;
+        auto packet = create_chunk_packet(*chunk, is_final, session.file_id, &session);
+        std::string receiver_id = session.receiver_id;
+
+        lock.unlock();
+        bool delivered = data_sender && data_sender(receiver_id, packet);
+        lock.lock();
+
+        if (!delivered && session.active) {
+            // The link refused the packet: back off, then resend it before anything new
+            auto in = session.in_flight.find(offset);
+            if (in != session.in_flight.end()) {
+                session.resume_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(BACKOFF_MS * (in->second.retry_count + 1));
+                queue_retransmit(session, offset, true);
+            }
+            return SendStep::IDLE;
+        }
+        return SendStep::SENT;
     }
 
-    void process_transfer_queue() {
-        while (!stop_processing) {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            queue_cv.wait(lock, [this]() { return !transfer_queue.empty() || stop_processing; });
-
-            if (stop_processing) break;
+    // Earliest time the receiver's link may take more file data under the bandwidth limits
+    std::chrono::steady_clock::time_point send_allowed_at(const std::string& receiver_id, std::chrono::steady_clock::time_point now) {
+        auto allowed = global_bucket.ready_at(now);
+        auto peer = peer_buckets.find(receiver_id);
+        if (peer != peer_buckets.end()) {
+            allowed = std::max(allowed, peer->second.ready_at(now));
+        }
+        return allowed;
+    }
 
-            std::string file_id = transfer_queue.front();
-            transfer_queue.pop();
-            lock.unlock();
+    // Removes the session before reporting, so the same file can be sent again
+    // from the completion callback on; a failed one resumes from its saved state.
+    // session is gone once this returns.
+    void finish_session(TransferSession& session, bool completed, const std::string& error, std::unique_lock<std::mutex>& lock) {
+        std::string file_id = session.file_id;
+        if (completed) {
+            sending_resume.erase(file_id);
+            database.delete_resume_state(file_id);
+            database.update_file_status(file_id, "complete");
+        }
+        auto& ring = peer_sessions[session.receiver_id];
+        ring.erase(std::remove(ring.begin(), ring.end(), file_id), ring.end());
+
+        CompletionCallback completion_cb = std::move(session.completion_cb);
+        active_transfers.erase(file_id);
+        lock.unlock();
+        if (completion_cb) {
+            completion_cb(completed, error);
+        }
+        lock.lock();
+    }
 
-            // Process transfer
-            std::unique_lock<std::mutex> transfer_lock(transfer_mutex);
+    // Deficit round-robin over one receiver's sessions: the next session with
+    // work earns weight * DRR_QUANTUM bytes of credit and sends while it lasts.
+    // Sessions with nothing to send don't bank credit.
+    void serve_peer(const std::string& receiver_id, std::unique_lock<std::mutex>& lock) {
+        auto& ring = peer_sessions[receiver_id];
+        for (size_t visited = 0; visited < ring.size() && !stop_processing; ++visited) {
+            std::string file_id = ring.front();
+            ring.pop_front();
+            ring.push_back(file_id);
             auto it = active_transfers.find(file_id);
-            if (it != active_transfers.end()) {
-                TransferSession& session = it->second;
-                if (session.paused) continue; // Skip if paused
-                transfer_lock.unlock();
-
-                // Send chunks
-                while (!session.chunk_queue.empty() && session.active && !session.paused) {
-                    FileChunk chunk = session.chunk_queue.front();
-                    session.chunk_queue.pop();
-                    bool is_final = session.chunk_queue.empty();
-
-                    auto packet = create_chunk_packet(chunk, is_final, session.file_id);
-                    if (data_sender && data_sender(session.receiver_id, packet)) {
-                        session.bytes_sent += chunk.data.size();
-                        session.sent_offsets.insert(chunk.offset);
-                        database.update_chunk_sent(session.file_id, chunk.offset, true);
-                        // Update progress
-                        if (session.progress_cb) {
-                            session.progress_cb(session.bytes_sent, session.file_size);
-                        }
-                    } else {
-                        // Retry logic
-                        if (chunk.retry_count < MAX_RETRIES) {
-                            chunk.retry_count++;
-                            session.chunk_queue.push(chunk); // Requeue
-                            database.add_transfer_chunk({session.file_id, chunk.offset, chunk.checksum, false, chunk.retry_count});
-                            std::this_thread::sleep_for(std::chrono::milliseconds(BACKOFF_MS * chunk.retry_count));
-                        } else {
-                            // Failed after max retries
-                            session.active = false;
-                            database.update_file_status(session.file_id, "failed");
-                            if (session.completion_cb) {
-                                session.completion_cb(false, "Transfer failed after max retries");
-                            }
-                            break;
-                        }
-                    }
+            if (it == active_transfers.end()) continue;
+            TransferSession& session = it->second;
+            if (!can_send(session, std::chrono::steady_clock::now())) {
+                session.deficit = 0;
+                continue;
+            }
 
-                    if (is_final && session.active) {
-                        database.update_file_status(session.file_id, "complete");
-                        if (session.completion_cb) {
-                            session.completion_cb(true, "");
-                        }
+            session.deficit += static_cast<int64_t>(session.weight) * DRR_QUANTUM;
+            while (session.deficit > 0 && !stop_processing && can_send(session, std::chrono::steady_clock::now())) {
+                auto now = std::chrono::steady_clock::now();
+                if (send_allowed_at(receiver_id, now) > now) break; // Over the bandwidth limit; credit is kept
+                if (link_writable && !link_writable(receiver_id)) break; // Link backed up; notify_link_ready resumes it
+                uint64_t sent_length = 0;
+                std::string error;
+                SendStep step = send_next(session, lock, sent_length, error);
+                if (step == SendStep::SENT) {
+                    session.deficit -= sent_length;
+                    now = std::chrono::steady_clock::now();
+                    global_bucket.consume(sent_length, now);
+                    auto peer = peer_buckets.find(receiver_id);
+                    if (peer != peer_buckets.end()) peer->second.consume(sent_length, now);
+                } else if (step == SendStep::COMPLETE || step == SendStep::FAILED) {
+                    finish_session(session, step == SendStep::COMPLETE, error, lock);
+                    return;
+                } else {
+                    break;
+                }
+            }
+            if (!can_send(session, std::chrono::steady_clock::now())) session.deficit = 0;
+            return;
+        }
+    }
+
+    // Pool worker: takes the next receiver nobody else is serving, so different
+    // peers send in parallel while each link sees one sender at a time
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(transfer_mutex);
+        while (!stop_processing) {
+            auto now = std::chrono::steady_clock::now();
+            auto wake = std::chrono::steady_clock::time_point::max();
+            std::string receiver_id;
+            for (size_t i = 0; i < peer_order.size() && receiver_id.empty(); ) {
+                std::string candidate = peer_order[i];
+                bool busy = busy_peers.count(candidate) > 0;
+                auto& ring = peer_sessions[candidate];
+                if (ring.empty() && !busy) {
+                    peer_sessions.erase(candidate);
+                    peer_order.erase(peer_order.begin() + i);
+                    continue;
+                }
+                ++i;
+                if (busy) continue;
+                if (link_writable && !link_writable(candidate)) continue;
+                auto allowed = send_allowed_at(candidate, now);
+                if (allowed > now) {
+                    wake = std::min(wake, allowed);
+                    continue;
+                }
+                for (const auto& file_id : ring) {
+                    auto it = active_transfers.find(file_id);
+                    if (it == active_transfers.end()) continue;
+                    if (can_send(it->second, now)) {
+                        receiver_id = candidate;
+                        break;
                     }
+                    std::chrono::steady_clock::time_point deadline;
+                    if (next_deadline(it->second, deadline)) wake = std::min(wake, deadline);
                 }
             }
+
+            if (receiver_id.empty()) {
+                if (wake == std::chrono::steady_clock::time_point::max()) {
+                    transfer_cv.wait(lock);
+                } else {
+                    transfer_cv.wait_until(lock, wake);
+                }
+                continue;
+            }
+
+            // Rotate so the next worker starts from another receiver
+            peer_order.erase(std::find(peer_order.begin(), peer_order.end(), receiver_id));
+            peer_order.push_back(receiver_id);
+            busy_peers.insert(receiver_id);
+            serve_peer(receiver_id, lock);
+            busy_peers.erase(receiver_id);
+            transfer_cv.notify_all(); // The receiver may have more work for another worker
         }
     }
+
+    // Retires the chunks a SACK covers and NACKs the ones it shows missing
+    void handle_sack(const std::string& sender_id, uint32_t connection_id, const std::vector<uint8_t>& sack) {
+        if (sack.size() < 4) return;
+        uint64_t base = read_u32(sack.data());
+        auto acked = [&](uint64_t index) {
+            if (index < base) return true;
+            if (index == base) return false;
+            uint64_t bit = index - base - 1;
+            return 4 + bit / 8 < sack.size() && ((sack[4 + bit / 8] >> (bit % 8)) & 1);
+        };
+
+        std::unique_lock<std::mutex> lock(transfer_mutex);
+        TransferSession* session = nullptr;
+        for (auto& entry : active_transfers) {
+            if (entry.second.connection_id == connection_id && entry.second.active) {
+                session = &entry.second;
+                break;
+            }
+        }
+        // Only the session's receiver may acknowledge it, and only chunks it has
+        if (!session || session->receiver_id != sender_id) return;
+        uint64_t chunk_count = (session->file_size + SEND_CHUNK_SIZE - 1) / SEND_CHUNK_SIZE;
+        if (base > chunk_count) return;
+
+        bool progressed = false;
+        for (auto it = session->in_flight.begin(); it != session->in_flight.end(); ) {
+            FileChunk& chunk = it->second;
+            if (!acked(chunk.offset / SEND_CHUNK_SIZE)) {
+                ++it;
+                continue;
+            }
+            if (session->sent_offsets.insert(chunk.offset).second) {
+                session->bytes_sent += chunk.length; // The final chunk may have been counted before resume
+            }
+            session->acked_sequence_end = std::max(session->acked_sequence_end, chunk.send_sequence + 1);
+            if (session->source) session->source->release(chunk.offset, chunk.length);
+            sending_resume[session->file_id].complete(chunk.offset / SEND_CHUNK_SIZE);
+            it = session->in_flight.erase(it);
+            progressed = true;
+        }
+
+        // Chunks the receiver already holds from an earlier attempt are skipped by the producer
+        uint64_t sack_end = std::min(chunk_count, base + 1 + (sack.size() - 4) * 8);
+        for (uint64_t index = session->next_offset / SEND_CHUNK_SIZE; index < sack_end; ++index) {
+            uint64_t offset = index * SEND_CHUNK_SIZE;
+            if (offset < session->next_offset || offset >= session->file_size || !acked(index)) continue;
+            if (session->sent_offsets.insert(offset).second) {
+                sending_resume[session->file_id].complete(index);
+                session->bytes_sent += std::min(SEND_CHUNK_SIZE, session->file_size - offset);
+                progressed = true;
+            }
+        }
+
+        // A chunk is lost, not just late, once something sent after it has been acknowledged
+        for (const auto& entry : session->in_flight) {
+            if (entry.second.send_sequence + 1 < session->acked_sequence_end) {
+                queue_retransmit(*session, entry.first, false);
+            }
+        }
+        flush_resume_state(sending_resume, session->file_id, false);
+
+        ProgressCallback progress_cb = progressed ? session->progress_cb : nullptr;
+        uint64_t sent = session->bytes_sent;
+        uint64_t total = session->file_size;
+        lock.unlock();
+        transfer_cv.notify_all();
+        if (progress_cb) {
+            progress_cb(sent, total);
+        }
+    }
+
+    // Feeds the receiver's digest in file order as chunks land. Chunks ahead of
+    // the gap-free prefix wait in memory (bounded by HASH_PENDING_CHUNKS); ones
+    // that didn't fit, or were on disk from before a resume, are read back once
+    // the prefix reaches them. The digest is final when the last chunk is written.
+    bool advance_digest(const std::string& file_id, uint64_t chunk_offset, const std::vector<uint8_t>& body) {
+        // Dropped after an earlier read-back failed; verification fails on completion
+        if (!receiving_hashers[file_id]) return false;
+        StreamHasher& hasher = *receiving_hashers[file_id];
+        auto& pending = receiving_pending[file_id];
+        if (chunk_offset == hasher.bytes_hashed()) {
+            hasher.update(body.data(), body.size());
+        } else if (pending.size() < HASH_PENDING_CHUNKS) {
+            pending.emplace(chunk_offset, body);
+        }
+
+        ChunkBitmap& received = receiving_chunks[file_id];
+        uint64_t size = receiving_sizes[file_id];
+        std::vector<uint8_t> landed;
+        while (hasher.bytes_hashed() < size && received.test(hasher.bytes_hashed() / SEND_CHUNK_SIZE)) {
+            uint64_t next = hasher.bytes_hashed();
+            auto it = pending.find(next);
+            if (it != pending.end()) {
+                hasher.update(it->second.data(), it->second.size());
+                pending.erase(it);
+            } else {
+                if (!receiving_files[file_id]->read(next, std::min(SEND_CHUNK_SIZE, size - next), landed)) return false;
+                hasher.update(landed.data(), landed.size());
+            }
+        }
+        return true;
+    }
+
+    // Writes one received chunk at its offset and returns the SACK to send back, if
+    // one is due. Caller holds receive_mutex.
+    std::vector<uint8_t> land_chunk(const std::string& file_id, const IncomingChunk& chunk) {
+        ChunkBitmap& received = receiving_chunks[file_id];
+        const std::vector<uint8_t>& body = chunk.body;
+        uint64_t index = chunk.offset / SEND_CHUNK_SIZE;
+
+        // Only whole chunks at chunk boundaries inside the announced size, so a
+        // bad offset or length can't overwrite a neighbour or grow the file
+        uint64_t size = receiving_sizes[file_id];
+        if (chunk.offset % SEND_CHUNK_SIZE != 0 || chunk.offset >= size ||
+            body.size() != std::min(SEND_CHUNK_SIZE, size - chunk.offset)) {
+            return {};
+        }
+
+        // Resent after the transfer finished and its final SACK was lost
+        if (received.complete() && receiving_ended.count(file_id)) {
+            return create_sack_packet(receiving_connection_ids[file_id], received);
+        }
+
+        // A chunk that doesn't match its hash is dropped; the SACK leaves it missing
+        // so only that chunk is sent again
+        ChunkHash leaf = hash_chunk(body.data(), body.size());
+        if (!chunk.hash.empty() && (chunk.hash.size() != leaf.size() || !std::equal(leaf.begin(), leaf.end(), chunk.hash.begin()))) {
+            return create_sack_packet(receiving_connection_ids[file_id], received);
+        }
+
+        // Retransmitted chunks are acknowledged again but written only once
+        if (received.set(index)) {
+            if (!receiving_files[file_id] || !receiving_files[file_id]->write(chunk.offset, body.data(), body.size())) {
+                received.unset(index); // Let the sender's retransmit try again
+                return {};
+            }
+            receiving_leaves[file_id][index] = leaf;
+            received_bytes[file_id] += body.size();
+            if (!advance_digest(file_id, chunk.offset, body)) {
+                receiving_hashers[file_id].reset(); // Verification fails below rather than hashing a gap
+            }
+            // Sent flag on the receiving side means the chunk is on disk, for resume
+            // Completed on the receiving side means the chunk is on disk
+            ResumeRecord& record = receiving_resume[file_id];
+            if (index < record.state.checksums.size()) record.state.checksums[index] = crc32(body.data(), body.size());
+            record.complete(index);
+            flush_resume_state(receiving_resume, file_id, false);
+            if (receiving_progress[file_id]) {
+                receiving_progress[file_id](received_bytes[file_id], receiving_sizes[file_id]);
+            }
+        }
+        if (!chunk.checksum.empty()) {
+            receiving_checksums[file_id] = chunk.checksum;
+        }
+        if (!chunk.merkle_root.empty()) {
+            receiving_roots[file_id] = chunk.merkle_root;
+        }
+        if (chunk.end_of_body) {
+            receiving_ended.insert(file_id);
+        }
+
+        // Acknowledge every few chunks, and straight away when there is a gap to NACK
+        std::vector<uint8_t> sack;
+        bool has_gap = received.contiguous() < received.end();
+        if (has_gap || received.complete() || chunk.end_of_body || ++receiving_unacked[file_id] >= ACK_EVERY_CHUNKS) {
+            sack = create_sack_packet(receiving_connection_ids[file_id], received);
+            receiving_unacked[file_id] = 0;
+        }
+
+        // END_OF_BODY only marks the last offset; retransmits may still be outstanding.
+        // A resumed transfer can have every chunk on disk before its final chunk
+        // brings the trailer, so both are needed.
+        if (received.complete() && receiving_ended.count(file_id)) {
+            receiving_files[file_id]->close();
+            receiving_resume.erase(file_id);
+            database.delete_resume_state(file_id);
+            auto& hasher = receiving_hashers[file_id];
+            bool digest_ok = hasher && hasher->bytes_hashed() == receiving_sizes[file_id] &&
+                             hasher->hex_digest() == receiving_checksums[file_id];
+            // Senders without chunk hashes send no root
+            const auto& root = receiving_roots[file_id];
+            bool root_ok = root.empty() || merkle_root(std::move(receiving_leaves[file_id])) == root;
+            bool success = digest_ok && root_ok;
+            receiving_pending.erase(file_id);
+            receiving_leaves.erase(file_id);
+            receiving_roots.erase(file_id);
+            if (receiving_completion[file_id]) {
+                receiving_completion[file_id](success, success ? "" : (digest_ok ? "Merkle root mismatch" : "Checksum mismatch"));
+            }
+            if (current_file_id == file_id) current_file_id.clear();
+        }
+        return sack;
+    }
 };
 
 FileTransfer::FileTransfer(Crypto& crypto, Database& database) : pimpl(std::make_unique<Impl>(crypto, database)) {
-    // Start transfer processing thread
-    std::thread(&Impl::process_transfer_queue, pimpl.get()).detach();
+    // Start the transfer worker pool
+    for (size_t i = 0; i < WORKER_THREADS; ++i) {
+        pimpl->workers.emplace_back(&Impl::worker_loop, pimpl.get());
+    }
 }
 
 FileTransfer::~FileTransfer() {
-    pimpl->stop_processing = true;
-    pimpl->queue_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+        pimpl->stop_processing = true;
+    }
+    pimpl->transfer_cv.notify_all();
+    for (auto& worker : pimpl->workers) {
+        worker.join();
+    }
+
+    // Unfinished transfers pick up from here when the file is sent again
+    for (auto& record : pimpl->sending_resume) {
+        pimpl->flush_resume_state(pimpl->sending_resume, record.first, true);
+    }
+    std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
+    for (auto& record : pimpl->receiving_resume) {
+        pimpl->flush_resume_state(pimpl->receiving_resume, record.first, true);
+    }
 }
 
 bool FileTransfer::pause_send(const std::string& file_id) {
@@ -240,7 +1162,9 @@ bool FileTransfer::pause_send(const std::string& file_id) {
     auto it = pimpl->active_transfers.find(file_id);
     if (it != pimpl->active_transfers.end()) {
         it->second.paused = true;
+        pimpl->flush_resume_state(pimpl->sending_resume, file_id, true);
         pimpl->database.update_file_status(file_id, "paused");
+        pimpl->transfer_cv.notify_all();
         return true;
     }
     return false;
@@ -252,12 +1176,37 @@ bool FileTransfer::resume_send(const std::string& file_id) {
     if (it != pimpl->active_transfers.end()) {
         it->second.paused = false;
         pimpl->database.update_file_status(file_id, "in_progress");
-        // Re-queue if not already
-        {
-            std::lock_guard<std::mutex> qlock(pimpl->queue_mutex);
-            pimpl->transfer_queue.push(file_id);
+        pimpl->transfer_cv.notify_all();
+        return true;
+    }
+    return false;
+}
+
+void FileTransfer::set_bandwidth_limit(uint64_t bytes_per_second) {
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+        pimpl->global_bucket.set_rate(bytes_per_second, std::chrono::steady_clock::now());
+    }
+    pimpl->transfer_cv.notify_all();
+}
+
+void FileTransfer::set_peer_bandwidth_limit(const std::string& receiver_id, uint64_t bytes_per_second) {
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+        if (bytes_per_second == 0) {
+            pimpl->peer_buckets.erase(receiver_id);
+        } else {
+            pimpl->peer_buckets[receiver_id].set_rate(bytes_per_second, std::chrono::steady_clock::now());
         }
-        pimpl->queue_cv.notify_one();
+    }
+    pimpl->transfer_cv.notify_all();
+}
+
+bool FileTransfer::set_transfer_priority(const std::string& file_id, uint32_t weight) {
+    std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+    auto it = pimpl->active_transfers.find(file_id);
+    if (it != pimpl->active_transfers.end()) {
+        it->second.weight = std::max<uint32_t>(weight, 1);
         return true;
     }
     return false;
@@ -278,13 +1227,20 @@ std::vector<uint8_t> FileTransfer::create_connect_packet() {
     return packet;
 }
 
-std::vector<uint8_t> FileTransfer::create_put_packet(const std::string& filename, uint64_t file_size, const std::vector<uint8_t>& data, bool is_final, const std::string& session_id) {
+std::vector<uint8_t> FileTransfer::create_put_packet(const std::string& filename, uint64_t file_size, const std::vector<uint8_t>& data, bool is_final, const std::string& session_id, uint32_t connection_id) {
     std::vector<uint8_t> packet;
     std::vector<uint8_t> headers;
 
     // Encrypt data
     auto encrypted_data = pimpl->crypto.encrypt_message(session_id, data);
 
+    // Connection id comes first so the receiver can tie later chunks and SACKs to this transfer
+    if (connection_id) {
+        pimpl->append_u32_header(headers, OBEXHeaderId::CONNECTION, connection_id);
+        pimpl->append_bytes_header(headers, OBEXHeaderId::TRANSFER_ID,
+                                   reinterpret_cast<const uint8_t*>(session_id.data()), session_id.size());
+    }
+
     // Name header
     auto name_data = pimpl->encode_unicode(filename);
     uint16_t name_len = 3 + name_data.size(); // HI + Len + data
@@ -293,12 +1249,8 @@ std::vector<uint8_t> FileTransfer::create_put_packet(const std::string& filename
     headers.push_back(name_len & 0xFF);
     headers.insert(headers.end(), name_data.begin(), name_data.end());
 
-    // Length header
+    // Length header (4-byte quantity, no length prefix)
     headers.push_back(static_cast<uint8_t>(OBEXHeaderId::LENGTH));
-    headers.push_back(0x00);
-    headers.push_back(0x00);
-    headers.push_back(0x00);
-    headers.push_back(0x05); // 5 bytes for length
     headers.push_back((file_size >> 24) & 0xFF);
     headers.push_back((file_size >> 16) & 0xFF);
     headers.push_back((file_size >> 8) & 0xFF);
@@ -323,28 +1275,7 @@ std::vector<uint8_t> FileTransfer::create_put_packet(const std::string& filename
 }
 
 std::vector<uint8_t> FileTransfer::create_chunk_packet(const FileChunk& chunk, bool is_final, const std::string& session_id) {
-    std::vector<uint8_t> packet;
-    std::vector<uint8_t> headers;
-
-    // Encrypt data
-    auto encrypted_data = pimpl->crypto.encrypt_message(session_id, chunk.data);
-
-    // Body or End-of-Body
-    uint8_t body_hi = is_final ? static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY) : static_cast<uint8_t>(OBEXHeaderId::BODY);
-    uint16_t body_len = 3 + encrypted_data.size();
-    headers.push_back(body_hi);
-    headers.push_back(body_len >> 8);
-    headers.push_back(body_len & 0xFF);
-    headers.insert(headers.end(), encrypted_data.begin(), encrypted_data.end());
-
-    OBEXHeader obex_header;
-    obex_header.opcode = static_cast<uint8_t>(OBEXOpcode::PUT);
-    obex_header.length = sizeof(OBEXHeader) + headers.size();
-
-    packet.insert(packet.end(), reinterpret_cast<uint8_t*>(&obex_header), reinterpret_cast<uint8_t*>(&obex_header) + sizeof(obex_header));
-    packet.insert(packet.end(), headers.begin(), headers.end());
-
-    return packet;
+    return pimpl->create_chunk_packet(chunk, is_final, session_id);
 }
 
 std::vector<uint8_t> FileTransfer::create_disconnect_packet() {
@@ -395,24 +1326,21 @@ bool FileTransfer::send_file(const std::string& path, const std::string& receive
         return false;
     }
 
-    std::string checksum = pimpl->sha256_file(path);
-    if (checksum.empty()) {
-        if (completion_cb) completion_cb(false, "Failed to calculate checksum");
-        return false;
-    }
-
-    std::string file_id = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    std::string file_id = Impl::transfer_key(file_path, file_size, receiver_id);
     std::string filename = file_path.filename().string();
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+        if (pimpl->active_transfers.count(file_id)) {
+            if (completion_cb) completion_cb(false, "Already sending this file");
+            return false;
+        }
+    }
 
-    // Add to database
-    File file_record{file_id, "self", receiver_id, filename, (int64_t)file_size, checksum, path, "", "in_progress"};
-    pimpl->database.add_file(file_record);
-
-    // Create chunks and store in database
-    auto chunks = pimpl->create_chunks(path, file_id);
-    for (auto& chunk : chunks) {
-        FileTransferChunk db_chunk{file_id, chunk.offset, chunk.checksum, false, 0};
-        pimpl->database.add_transfer_chunk(db_chunk);
+    // Add to database, the checksum is filled in once the last chunk has been read.
+    // A file sent before already has its row
+    File file_record{file_id, "self", receiver_id, filename, (int64_t)file_size, "", path, "", "in_progress"};
+    if (!pimpl->database.add_file(file_record)) {
+        pimpl->database.update_file_status(file_id, "in_progress");
     }
 
     // Create transfer session
@@ -420,41 +1348,68 @@ bool FileTransfer::send_file(const std::string& path, const std::string& receive
     session.file_id = file_id;
     session.filename = filename;
     session.file_size = file_size;
-    session.checksum = checksum;
     session.receiver_id = receiver_id;
     session.bytes_sent = 0;
+    session.source = std::make_shared<ChunkSource>(path);
+    session.hasher = std::make_shared<StreamHasher>();
+    session.chunk_hashes.resize((file_size + SEND_CHUNK_SIZE - 1) / SEND_CHUNK_SIZE);
+    session.next_offset = 0;
+    session.connection_id = pimpl->next_connection_id++;
+    session.next_send_sequence = 0;
+    session.acked_sequence_end = 0;
+    session.weight = DEFAULT_PRIORITY;
+    session.deficit = 0;
     session.active = true;
     session.paused = false;
     session.progress_cb = progress_cb;
     session.completion_cb = completion_cb;
 
-    // Load sent offsets from database
-    auto db_chunks = pimpl->database.get_transfer_chunks(file_id);
-    for (const auto& db_chunk : db_chunks) {
-        if (db_chunk.sent) {
-            session.sent_offsets.insert(db_chunk.offset);
-            session.bytes_sent += CHUNK_SIZE; // Approximate
+    // Load acknowledged chunks from an earlier attempt
+    uint64_t chunk_count = session.chunk_hashes.size();
+    ResumeRecord resume;
+    if (!pimpl->database.get_resume_state(file_id, resume.state) || !resume.matches(SEND_CHUNK_SIZE, chunk_count)) {
+        resume.reset(file_id, SEND_CHUNK_SIZE, chunk_count);
+    }
+    for (uint64_t index = 0; index < chunk_count; ++index) {
+        if (resume.completed(index)) {
+            session.sent_offsets.insert(index * SEND_CHUNK_SIZE);
+            session.bytes_sent += std::min(SEND_CHUNK_SIZE, file_size - index * SEND_CHUNK_SIZE);
         }
     }
 
-    // Only queue unsent chunks
-    for (auto& chunk : chunks) {
-        if (session.sent_offsets.find(chunk.offset) == session.sent_offsets.end()) {
-            session.chunk_queue.push(chunk);
-        }
+    if (!session.source->is_open()) {
+        pimpl->database.update_file_status(file_id, "failed");
+        if (completion_cb) completion_cb(false, "Failed to open file");
+        return false;
     }
 
+    // Chunks are read on demand by the transfer thread, only the first window up front
+    uint32_t connection_id = session.connection_id;
+    bool duplicate = false;
+    bool filled = false;
     {
         std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
-        pimpl->active_transfers[file_id] = std::move(session);
+        // Checked again under the lock that inserts it, in case of a concurrent send
+        duplicate = pimpl->active_transfers.count(file_id) > 0;
+        if (!duplicate) {
+            pimpl->sending_resume[file_id] = std::move(resume);
+            filled = pimpl->fill_read_ahead(session);
+            if (filled) {
+                pimpl->active_transfers.emplace(file_id, std::move(session));
+            } else {
+                pimpl->sending_resume.erase(file_id);
+            }
+        }
     }
-
-    // Queue for processing
-    {
-        std::lock_guard<std::mutex> lock(pimpl->queue_mutex);
-        pimpl->transfer_queue.push(file_id);
+    if (duplicate) {
+        if (completion_cb) completion_cb(false, "Already sending this file");
+        return false;
+    }
+    if (!filled) {
+        pimpl->database.update_file_status(file_id, "failed");
+        if (completion_cb) completion_cb(false, "Failed to read file");
+        return false;
     }
-    pimpl->queue_cv.notify_one();
 
     // Send Connect packet first
     auto connect_packet = create_connect_packet();
@@ -462,38 +1417,118 @@ bool FileTransfer::send_file(const std::string& path, const std::string& receive
         pimpl->data_sender(receiver_id, connect_packet);
     }
 
-    // Send initial PUT packet with metadata (no body for chunked)
-    auto put_packet = create_put_packet(filename, file_size, {}, false, file_id);
+    // Send initial PUT packet with metadata (no body for chunked) before any chunk can go out
+    auto put_packet = create_put_packet(filename, file_size, {}, false, file_id, connection_id);
     if (pimpl->data_sender) {
         pimpl->data_sender(receiver_id, put_packet);
     }
 
+    // Hand the session to the scheduler
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+        auto& ring = pimpl->peer_sessions[receiver_id];
+        if (ring.empty() && std::find(pimpl->peer_order.begin(), pimpl->peer_order.end(), receiver_id) == pimpl->peer_order.end()) {
+            pimpl->peer_order.push_back(receiver_id);
+        }
+        ring.push_back(file_id);
+    }
+    pimpl->transfer_cv.notify_all();
+
     return true;
 }
 
 bool FileTransfer::receive_file(const std::string& file_id, const std::string& filename, uint64_t size,
                                 const std::string& checksum, const std::string& save_path,
                                 ProgressCallback progress_cb, CompletionCallback completion_cb) {
+    // Chunks already on disk from an earlier attempt at this file_id are kept
+    uint64_t chunk_count = (size + SEND_CHUNK_SIZE - 1) / SEND_CHUNK_SIZE;
+    {
+        // An attempt still under way hands over what it has landed
+        std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
+        if (pimpl->receiving_resume.count(file_id)) {
+            pimpl->flush_resume_state(pimpl->receiving_resume, file_id, true);
+        }
+    }
+    ResumeRecord resume;
+    bool resuming = pimpl->database.get_resume_state(file_id, resume.state) && resume.matches(SEND_CHUNK_SIZE, chunk_count) &&
+                    std::filesystem::exists(save_path);
+    if (!resuming) {
+        resume.reset(file_id, SEND_CHUNK_SIZE, chunk_count);
+    }
+
     std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
     pimpl->current_file_id = file_id;
-    pimpl->receiving_files[file_id] = std::ofstream(save_path, std::ios::binary);
+    pimpl->receiving_files[file_id] = std::make_unique<ChunkSink>(save_path, size, resuming);
     pimpl->received_bytes[file_id] = 0;
     pimpl->receiving_checksums[file_id] = checksum;
     pimpl->receiving_paths[file_id] = save_path;
     pimpl->receiving_sizes[file_id] = size;
     pimpl->receiving_completion[file_id] = completion_cb;
     pimpl->receiving_progress[file_id] = progress_cb;
-    return true;
+    ChunkBitmap& received = pimpl->receiving_chunks[file_id];
+    received = ChunkBitmap();
+    received.resize(chunk_count);
+    pimpl->receiving_unacked[file_id] = 0;
+    pimpl->receiving_hashers[file_id] = std::make_unique<StreamHasher>();
+    pimpl->receiving_pending[file_id].clear();
+    auto& leaves = pimpl->receiving_leaves[file_id];
+    leaves.assign(received.size(), ChunkHash{});
+    pimpl->receiving_roots.erase(file_id);
+    pimpl->receiving_ended.erase(file_id);
+    StreamHasher& hasher = *pimpl->receiving_hashers[file_id];
+    if (resuming) {
+        // Only chunks that still match the CRC recorded when they landed are kept;
+        // anything torn by a crash is asked for again
+        std::vector<uint8_t> on_disk;
+        for (uint64_t index = 0; index < chunk_count; ++index) {
+            if (!resume.completed(index)) continue;
+            uint64_t offset = index * SEND_CHUNK_SIZE;
+            uint64_t length = std::min(SEND_CHUNK_SIZE, size - offset);
+            if (!pimpl->receiving_files[file_id]->read(offset, length, on_disk) ||
+                pimpl->crc32(on_disk.data(), on_disk.size()) != resume.state.checksums[index]) {
+                resume.clear(index);
+                continue;
+            }
+            received.set(index);
+            leaves[index] = hash_chunk(on_disk.data(), on_disk.size());
+            // The gap-free prefix goes into the digest now; chunks past a gap are
+            // read back once the gap is filled
+            if (hasher.bytes_hashed() == offset) hasher.update(on_disk.data(), on_disk.size());
+            pimpl->received_bytes[file_id] += length;
+        }
+        // Acknowledge on the first chunk so the sender skips what is already here
+        pimpl->receiving_unacked[file_id] = ACK_EVERY_CHUNKS;
+    }
+    pimpl->receiving_resume[file_id] = std::move(resume);
+    return pimpl->receiving_files[file_id]->is_open();
 }
 
 void FileTransfer::set_data_sender(std::function<bool(const std::string& device_id, const std::vector<uint8_t>& data)> sender) {
     pimpl->data_sender = sender;
 }
 
+void FileTransfer::set_link_writable_check(std::function<bool(const std::string& device_id)> check) {
+    pimpl->link_writable = check;
+}
+
+void FileTransfer::notify_link_ready(const std::string& device_id) {
+    (void)device_id;
+    // Taking the lock orders this after a worker that just saw the link backed up
+    // has gone to sleep, so the wakeup isn't lost
+    {
+        std::lock_guard<std::mutex> lock(pimpl->transfer_mutex);
+    }
+    pimpl->transfer_cv.notify_all();
+}
+
 void FileTransfer::set_incoming_file_callback(IncomingFileCallback callback) {
     pimpl->incoming_file_callback = callback;
 }
 
+void FileTransfer::set_received_file_callback(ReceivedFileCallback callback) {
+    pimpl->received_file_callback = callback;
+}
+
 void FileTransfer::receive_packet(const std::string& sender_id, const std::vector<uint8_t>& data) {
     OBEXHeader header;
     std::vector<uint8_t> headers;
@@ -501,82 +1536,104 @@ void FileTransfer::receive_packet(const std::string& sender_id, const std::vecto
 
     if (header.opcode == static_cast<uint8_t>(OBEXOpcode::CONNECT)) {
         // Handle connect - perhaps initiate transfer
+    } else if (header.opcode == static_cast<uint8_t>(OBEXOpcode::CONTINUE) || header.opcode == static_cast<uint8_t>(OBEXOpcode::SUCCESS)) {
+        // Acknowledgement for one of our outgoing transfers
+        size_t offset = 0;
+        uint32_t connection_id = 0;
+        uint8_t hi;
+        std::vector<uint8_t> value;
+        while (pimpl->next_header(headers, offset, hi, value)) {
+            if (hi == static_cast<uint8_t>(OBEXHeaderId::CONNECTION) && value.size() == 4) {
+                connection_id = pimpl->read_u32(value.data());
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::SACK)) {
+                pimpl->handle_sack(sender_id, connection_id, value);
+            }
+        }
     } else if (header.opcode == static_cast<uint8_t>(OBEXOpcode::PUT)) {
         // Parse headers
         size_t offset = 0;
         std::string filename;
         uint64_t file_size = 0;
-        std::vector<uint8_t> body;
-        uint8_t last_hi = 0;
-
-        while (offset < headers.size()) {
-            uint8_t hi = headers[offset++];
-            uint16_t len = (headers[offset] << 8) | headers[offset + 1];
-            offset += 2;
-
-            std::vector<uint8_t> value(headers.begin() + offset, headers.begin() + offset + len - 3);
-            offset += len - 3;
-
+        uint32_t connection_id = 0;
+        std::string transfer_id;
+        bool has_chunk_offset = false;
+        Impl::IncomingChunk chunk;
+        uint8_t hi;
+        std::vector<uint8_t> value;
+
+        while (pimpl->next_header(headers, offset, hi, value)) {
             if (hi == static_cast<uint8_t>(OBEXHeaderId::NAME)) {
                 filename = pimpl->decode_unicode(value);
             } else if (hi == static_cast<uint8_t>(OBEXHeaderId::LENGTH)) {
                 if (value.size() >= 4) {
-                    file_size = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+                    file_size = pimpl->read_u32(value.data());
                 }
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::CONNECTION) && value.size() == 4) {
+                connection_id = pimpl->read_u32(value.data());
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::TRANSFER_ID) && value.size() <= MAX_TRANSFER_ID) {
+                transfer_id.assign(value.begin(), value.end());
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::CHUNK_OFFSET) && value.size() == 4) {
+                chunk.offset = pimpl->read_u32(value.data());
+                has_chunk_offset = true;
             } else if (hi == static_cast<uint8_t>(OBEXHeaderId::BODY) || hi == static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY)) {
                 // Decrypt body
-                body = pimpl->crypto.decrypt_message(sender_id, value);
-                last_hi = hi;
+                chunk.body = pimpl->crypto.decrypt_message(sender_id, value);
+                chunk.end_of_body = hi == static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY);
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::CHUNK_HASH)) {
+                chunk.hash = pimpl->crypto.decrypt_message(sender_id, value);
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::CHECKSUM)) {
+                auto decrypted = pimpl->crypto.decrypt_message(sender_id, value);
+                chunk.checksum.assign(decrypted.begin(), decrypted.end());
+            } else if (hi == static_cast<uint8_t>(OBEXHeaderId::MERKLE_ROOT)) {
+                chunk.merkle_root = pimpl->crypto.decrypt_message(sender_id, value);
             }
         }
 
-        if (!filename.empty() && pimpl->incoming_file_callback && pimpl->current_file_id.empty()) {
-            pimpl->incoming_file_callback(filename, file_size, [this, filename, file_size, body, last_hi, sender_id](bool accept, const std::string& save_path) {
+        // Transfers with a connection id can overlap; legacy ones are taken one at a time
+        if (!filename.empty() && pimpl->incoming_file_callback && (connection_id || pimpl->current_file_id.empty())) {
+            pimpl->incoming_file_callback(filename, file_size, [this, filename, file_size, chunk, sender_id, connection_id, transfer_id](bool accept, const std::string& save_path) {
                 if (accept) {
-                    std::string file_id = pimpl->generate_id();
-                    std::string checksum = ""; // Should be received in headers, but simplified
-                    receive_file(file_id, filename, file_size, checksum, save_path, nullptr, nullptr);
+                    // Keyed by the sender's id for the transfer, so a re-send picks up what is on disk
+                    std::string file_id = transfer_id.empty() ? pimpl->generate_id() : "rx_" + sender_id + "_" + transfer_id;
+                    CompletionCallback completion_cb = nullptr;
+                    if (pimpl->received_file_callback) {
+                        completion_cb = [received = pimpl->received_file_callback, save_path](bool success, const std::string& error) {
+                            received(save_path, success, error);
+                        };
+                    }
+                    receive_file(file_id, filename, file_size, chunk.checksum, save_path, nullptr, completion_cb);
+                    std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
+                    pimpl->receiving_connection_ids[file_id] = connection_id;
+                    if (connection_id) {
+                        pimpl->receiving_by_connection[{sender_id, connection_id}] = file_id;
+                    }
                     // Process initial body if any
-                    if (!body.empty()) {
-                        std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
-                        pimpl->receiving_files[file_id].write(reinterpret_cast<const char*>(body.data()), body.size());
-                        pimpl->received_bytes[file_id] += body.size();
-                        if (last_hi == static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY)) {
-                            pimpl->receiving_files[file_id].close();
-                            // Verify checksum
-                            std::ifstream file(pimpl->receiving_paths[file_id], std::ios::binary);
-                            std::vector<uint8_t> file_data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-                            std::string calculated_checksum = pimpl->crypto.calculate_checksum(file_data);
-                            bool success = (calculated_checksum == pimpl->receiving_checksums[file_id]);
-                            if (pimpl->receiving_completion[file_id]) {
-                                pimpl->receiving_completion[file_id](success, success ? "" : "Checksum mismatch");
-                            }
-                            pimpl->current_file_id.clear();
+                    if (!chunk.body.empty()) {
+                        auto sack = pimpl->land_chunk(file_id, chunk);
+                        if (!sack.empty() && pimpl->data_sender) {
+                            pimpl->data_sender(sender_id, sack);
                         }
                     }
                 }
             });
-        } else if (!pimpl->current_file_id.empty() && !body.empty()) {
-            std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
-            // For chunked, assume body is a chunk, but simplified as whole
-            pimpl->receiving_files[pimpl->current_file_id].write(reinterpret_cast<const char*>(body.data()), body.size());
-            pimpl->received_bytes[pimpl->current_file_id] += body.size();
-            if (pimpl->receiving_progress[pimpl->current_file_id]) {
-                pimpl->receiving_progress[pimpl->current_file_id](pimpl->received_bytes[pimpl->current_file_id], pimpl->receiving_sizes[pimpl->current_file_id]);
-            }
-            if (last_hi == static_cast<uint8_t>(OBEXHeaderId::END_OF_BODY)) {
-                pimpl->receiving_files[pimpl->current_file_id].close();
-                std::ifstream file(pimpl->receiving_paths[pimpl->current_file_id], std::ios::binary);
-                std::vector<uint8_t> file_data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-                std::string calculated_checksum = pimpl->crypto.calculate_checksum(file_data);
-                bool success = (calculated_checksum == pimpl->receiving_checksums[pimpl->current_file_id]);
-                if (pimpl->receiving_completion[pimpl->current_file_id]) {
-                    pimpl->receiving_completion[pimpl->current_file_id](success, success ? "" : "Checksum mismatch");
+        } else if (!chunk.body.empty()) {
+            std::vector<uint8_t> sack;
+            {
+                std::lock_guard<std::mutex> lock(pimpl->receive_mutex);
+                std::string file_id = pimpl->current_file_id;
+                if (connection_id) {
+                    auto it = pimpl->receiving_by_connection.find({sender_id, connection_id});
+                    file_id = it != pimpl->receiving_by_connection.end() ? it->second : "";
                 }
-                pimpl->current_file_id.clear();
+                if (file_id.empty()) return; // Not accepted (yet); the sender will resend
+                if (!has_chunk_offset) chunk.offset = pimpl->received_bytes[file_id]; // Sequential sender
+                sack = pimpl->land_chunk(file_id, chunk);
+            }
+            if (!sack.empty() && pimpl->data_sender) {
+                pimpl->data_sender(sender_id, sack);
             }
         }
     } else if (header.opcode == static_cast<uint8_t>(OBEXOpcode::DISCONNECT)) {
         // Handle disconnect
     }
-}
\ No newline at end of file
+}
@@ -7,9 +7,15 @@
 #include <mutex>
 #include <condition_variable>
 #include <unordered_set>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <array>
 
 class Crypto;
 class Database;
+class ChunkSource;
+class StreamHasher;
 
 #pragma pack(push, 1)
 struct OBEXHeader {
@@ -30,7 +36,10 @@ enum class OBEXOpcode {
     PUT = 0x02,
     GET = 0x03,
     SETPATH = 0x85,
-    ABORT = 0xFF
+    ABORT = 0xFF,
+    // Response codes (final bit set)
+    CONTINUE = 0x90,
+    SUCCESS = 0xA0
 };
 
 enum class OBEXHeaderId {
@@ -49,30 +58,28 @@ enum class OBEXHeaderId {
     AUTH_RESPONSE = 0x4E,
     OBJECT_CLASS = 0x4F,
     BODY = 0x48,
-    END_OF_BODY = 0x49
+    END_OF_BODY = 0x49,
+    CHECKSUM = 0x70, // User-defined: encrypted SHA-256 of the whole file, sent before END_OF_BODY
+    SACK = 0x71, // User-defined: cumulative chunk count followed by a bitmap of chunks received past it
+    CHUNK_HASH = 0x72, // User-defined: encrypted SHA-256 of this chunk, a leaf of the file's Merkle tree
+    MERKLE_ROOT = 0x73, // User-defined: encrypted Merkle root over all chunk hashes, sent before END_OF_BODY
+    TRANSFER_ID = 0x74, // User-defined: the sender's stable id for the transfer, so a re-sent file resumes
+    CHUNK_OFFSET = 0xF0 // User-defined: file offset of the chunk in this packet
 };
 
 struct FileChunk {
     std::string file_id;
     uint64_t offset;
-    std::vector<uint8_t> data;
+    std::vector<uint8_t> data; // Owned copy, only used when the source is not memory-mapped
+    const uint8_t* view; // Points into the mapped source, nullptr when data is owned
+    uint64_t length;
     uint32_t checksum;
+    std::array<uint8_t, 32> hash; // SHA-256 of the chunk, its leaf in the file's Merkle tree
     int retry_count;
-};
+    std::chrono::steady_clock::time_point sent_at; // Last transmission, for ACK timeouts
+    uint64_t send_sequence; // Session-wide order of the last transmission
 
-struct TransferSession {
-    std::string file_id;
-    std::string filename;
-    uint64_t file_size;
-    std::string checksum;
-    std::string receiver_id;
-    uint64_t bytes_sent;
-    std::queue<FileChunk> chunk_queue;
-    std::unordered_set<uint64_t> sent_offsets;
-    bool active;
-    bool paused;
-    ProgressCallback progress_cb;
-    CompletionCallback completion_cb;
+    const uint8_t* bytes() const { return view ? view : data.data(); }
 };
 
 class FileTransfer {
@@ -83,6 +90,7 @@ public:
     using ProgressCallback = std::function<void(uint64_t sent, uint64_t total)>;
     using CompletionCallback = std::function<void(bool success, const std::string& error)>;
     using IncomingFileCallback = std::function<void(const std::string& filename, uint64_t size, std::function<void(bool accept, const std::string& save_path)> response)>;
+    using ReceivedFileCallback = std::function<void(const std::string& save_path, bool success, const std::string& error)>;
 
     bool send_file(const std::string& path, const std::string& receiver_id,
                     ProgressCallback progress_cb = nullptr,
@@ -92,19 +100,34 @@ public:
 
     bool pause_send(const std::string& file_id);
 
+    // Caps on outgoing file data in bytes per second, 0 for unlimited. The global
+    // cap covers all receivers; a receiver's own cap applies on top of it.
+    void set_bandwidth_limit(uint64_t bytes_per_second);
+    void set_peer_bandwidth_limit(const std::string& receiver_id, uint64_t bytes_per_second);
+
+    // Share of its receiver's link relative to the other transfers to that peer (default 1)
+    bool set_transfer_priority(const std::string& file_id, uint32_t weight);
+
     bool receive_file(const std::string& file_id, const std::string& filename, uint64_t size,
                         const std::string& checksum, const std::string& save_path,
                         ProgressCallback progress_cb = nullptr,
                         CompletionCallback completion_cb = nullptr);
 
     void set_incoming_file_callback(IncomingFileCallback callback);
+    // Outcome of each incoming file accepted through the incoming file callback,
+    // once it has been verified
+    void set_received_file_callback(ReceivedFileCallback callback);
 
     void set_data_sender(std::function<bool(const std::string& device_id, const std::vector<uint8_t>& data)> sender);
+    // Backpressure from the link: receivers whose link isn't writable get no new
+    // chunks until notify_link_ready is called for them
+    void set_link_writable_check(std::function<bool(const std::string& device_id)> check);
+    void notify_link_ready(const std::string& device_id);
     void receive_packet(const std::string& sender_id, const std::vector<uint8_t>& data);
 
     // OBEX protocol methods
     std::vector<uint8_t> create_connect_packet();
-    std::vector<uint8_t> create_put_packet(const std::string& filename, uint64_t file_size, const std::vector<uint8_t>& data, bool is_final, const std::string& session_id);
+    std::vector<uint8_t> create_put_packet(const std::string& filename, uint64_t file_size, const std::vector<uint8_t>& data, bool is_final, const std::string& session_id, uint32_t connection_id = 0);
     std::vector<uint8_t> create_chunk_packet(const FileChunk& chunk, bool is_final, const std::string& session_id);
     std::vector<uint8_t> create_disconnect_packet();
     std::vector<uint8_t> create_abort_packet();
@@ -116,7 +139,48 @@ private:
     static constexpr uint64_t MAX_FILE_SIZE = 4294967296; // 4GB
     static constexpr int MAX_RETRIES = 3;
     static constexpr int BACKOFF_MS = 1000;
+    static constexpr uint64_t SEND_CHUNK_SIZE = 61440; // Chunk plus headers must fit the 16-bit OBEX packet length
+    static constexpr size_t READ_AHEAD_CHUNKS = 8; // Chunks read ahead of the sender per session
+    static constexpr size_t WINDOW_CHUNKS = 8; // Unacknowledged chunks in flight per session
+    static constexpr int ACK_TIMEOUT_MS = 4000; // Resend a chunk if no SACK covers it in time
+    static constexpr int ACK_EVERY_CHUNKS = 4; // Receiver sends a SACK at least this often
+    static constexpr size_t SACK_BITMAP_CHUNKS = 256; // Chunks covered by one SACK bitmap
+    static constexpr size_t WORKER_THREADS = 4; // Transfers to different peers send in parallel
+    static constexpr uint32_t DEFAULT_PRIORITY = 1;
+    static constexpr int64_t DRR_QUANTUM = SEND_CHUNK_SIZE; // Bytes of credit per unit of priority per round
+    static constexpr size_t DB_FLUSH_CHUNKS = 64; // Chunks landed between resume-state flushes
+    static constexpr int DB_FLUSH_MS = 1000; // Longest resume state stays unsaved
+    static constexpr size_t MAX_TRANSFER_ID = 64; // Longest TRANSFER_ID header value taken from a peer
+    static constexpr size_t HASH_PENDING_CHUNKS = 16; // Out-of-order chunks held until the receiver's digest reaches them
 
     class Impl;
     std::unique_ptr<Impl> pimpl;
+};
+
+struct TransferSession {
+    std::string file_id;
+    std::string filename;
+    uint64_t file_size;
+    std::string checksum;
+    std::string receiver_id;
+    uint64_t bytes_sent;
+    std::shared_ptr<ChunkSource> source; // Open file the producer reads chunks from
+    std::shared_ptr<StreamHasher> hasher; // SHA-256 fed by the producer in file order
+    std::vector<std::array<uint8_t, 32>> chunk_hashes; // Merkle leaves by chunk index, filled by the producer
+    std::vector<uint8_t> merkle_root; // Set once the last chunk has been read
+    uint64_t next_offset; // Next offset the producer will read
+    std::queue<FileChunk> chunk_queue; // Bounded read-ahead window
+    std::map<uint64_t, FileChunk> in_flight; // Sent but not yet acknowledged, by offset
+    std::deque<uint64_t> retransmit_queue; // NACKed or timed-out offsets, resent before new chunks
+    std::unordered_set<uint64_t> sent_offsets; // Acknowledged by the receiver
+    uint32_t connection_id; // OBEX connection id tying packets and SACKs to this session
+    uint64_t next_send_sequence;
+    uint64_t acked_sequence_end; // One past the latest transmission the receiver acknowledged
+    uint32_t weight; // Scheduling priority among the receiver's sessions
+    int64_t deficit; // Deficit round-robin credit in bytes
+    std::chrono::steady_clock::time_point resume_at; // Backoff after the link refused a packet
+    bool active;
+    bool paused;
+    FileTransfer::ProgressCallback progress_cb;
+    FileTransfer::CompletionCallback completion_cb;
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "database/database.h"
 #include "crypto/crypto.h"
 #include "bluetooth/bluetooth.h"
+#include "bluetooth/connection_manager.h"
 #include "messaging/messaging.h"
 #include "file_transfer/file_transfer.h"
 #include "settings/settings.h"
@@ -27,22 +28,27 @@ int main(int argc, char* argv[]) {
     Crypto crypto;
     Bluetooth bluetooth;
     Messaging messaging(crypto);
-    FileTransfer file_transfer(crypto);
+    FileTransfer file_transfer(crypto, db);
+    ConnectionManager connections(bluetooth); // Torn down before what its callbacks reach
     Settings settings;
     AutoUpdate auto_update;
     UIImpl ui;
 
-    // Integrate with bluetooth
-    bluetooth.set_receive_callback([&messaging, &file_transfer](const std::string& device_id, const std::vector<uint8_t>& data) {
-        if (data.size() >= 4 && data[0] == 'F' && data[1] == 'T' && data[2] == 'A' && data[3] == 'P') {
-            file_transfer.receive_packet(device_id, data);
-        } else {
-            messaging.receive_data(device_id, data);
-        }
+    // Integrate with bluetooth. Each callback is one whole message; file transfer
+    // packets travel on their own channel so chat isn't stuck behind them
+    bluetooth.set_receive_callback([&messaging](const std::string& device_id, const std::vector<uint8_t>& data) {
+        messaging.receive_data(device_id, data);
+    });
+    bluetooth.set_channel_receive_callback(BluetoothChannel::FILE_TRANSFER, [&file_transfer](const std::string& device_id, const std::vector<uint8_t>& data) {
+        file_transfer.receive_packet(device_id, data);
     });
 
-    messaging.set_bluetooth_sender([&bluetooth](const std::string& device_id, const std::vector<uint8_t>& data) {
-        return bluetooth.send_data(device_id, data);
+    // Chat to a trusted peer is held through a dropped link and replayed on reconnect
+    messaging.set_bluetooth_sender([&connections](const std::string& device_id, const std::vector<uint8_t>& data) {
+        return connections.send_data(device_id, data);
+    });
+    messaging.set_rtt_callback([&bluetooth](const std::string& device_id, std::chrono::microseconds rtt) {
+        bluetooth.record_rtt_sample(device_id, rtt);
     });
 
     messaging.set_message_callback([&db](const std::string& id, const std::string& conversation_id,
@@ -55,8 +61,26 @@ int main(int argc, char* argv[]) {
     });
 
     file_transfer.set_data_sender([&bluetooth](const std::string& device_id, const std::vector<uint8_t>& data) {
-        return bluetooth.send_data(device_id, data);
+        return bluetooth.send_data(device_id, data, BluetoothChannel::FILE_TRANSFER);
+    });
+    file_transfer.set_link_writable_check([&bluetooth](const std::string& device_id) {
+        return bluetooth.is_writable(device_id);
     });
+    bluetooth.set_ready_callback([&file_transfer, &connections](const std::string& device_id) {
+        connections.notify_link_ready(device_id);
+        file_transfer.notify_link_ready(device_id);
+    });
+    connections.set_status_callback([&file_transfer](const std::string& device_id, bool online) {
+        std::cout << "Peer " << device_id << (online ? " reconnected" : " offline, still retrying") << std::endl;
+        if (online) file_transfer.notify_link_ready(device_id);
+    });
+
+    // Keep bulk transfers from starving chat on the same link
+    file_transfer.set_bandwidth_limit(static_cast<uint64_t>(settings.get_bandwidth_limit()) * 1024);
+    for (const auto& device_id : settings.get_trusted_devices()) {
+        file_transfer.set_peer_bandwidth_limit(device_id, static_cast<uint64_t>(settings.get_peer_bandwidth_limit(device_id)) * 1024);
+        connections.keep_connected(device_id); // Warm, so the first message doesn't pay for a connect
+    }
 
     // Start the UI main loop
     ui.run();
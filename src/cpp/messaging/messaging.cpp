@@ -1,31 +1,197 @@
 #include "messaging.h"
 #include "crypto/crypto.h"
 #include <cstring>
+#include <cstddef>
 #include <chrono>
 #include <iostream>
 #include <thread>
 #include <queue>
 #include <mutex>
 #include <functional>
+#include <map>
+#include <set>
+#include <random>
+#include <array>
+#include <algorithm>
+
+// LEB128 varints and ids for compact frames
+static void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool get_varint(std::span<const uint8_t> data, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; offset < data.size() && shift < 64; shift += 7) {
+        uint8_t byte = data[offset++];
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool get_varint32(std::span<const uint8_t> data, size_t& offset, uint32_t& value) {
+    uint64_t wide;
+    if (!get_varint(data, offset, wide) || wide > UINT32_MAX) return false;
+    value = static_cast<uint32_t>(wide);
+    return true;
+}
+
+// An id goes behind a varint of (length << 2) | kind. Canonical UUIDs, as
+// device and message ids usually are, take kind 1 (lowercase) or 2
+// (uppercase) and are sent as their 16 bytes with no length.
+enum IdKind { ID_STRING = 0, ID_UUID_LOWER = 1, ID_UUID_UPPER = 2 };
+static constexpr size_t UUID_TEXT_SIZE = 36;
+
+static int uuid_kind(const std::string& id) {
+    if (id.size() != UUID_TEXT_SIZE) return ID_STRING;
+    bool lower = false, upper = false;
+    for (size_t i = 0; i < id.size(); ++i) {
+        char c = id[i];
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (c != '-') return ID_STRING;
+        } else if (c >= 'a' && c <= 'f') {
+            lower = true;
+        } else if (c >= 'A' && c <= 'F') {
+            upper = true;
+        } else if (c < '0' || c > '9') {
+            return ID_STRING;
+        }
+    }
+    if (lower && upper) return ID_STRING; // Wouldn't come back the same
+    return upper ? ID_UUID_UPPER : ID_UUID_LOWER;
+}
+
+static uint8_t hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    return (c | 0x20) - 'a' + 10;
+}
+
+static void put_id(std::vector<uint8_t>& out, const std::string& id) {
+    int kind = uuid_kind(id);
+    put_varint(out, kind == ID_STRING ? uint64_t(id.size()) << 2 : kind);
+    if (kind == ID_STRING) {
+        out.insert(out.end(), id.begin(), id.end());
+        return;
+    }
+    for (size_t i = 0; i < id.size(); i += 2) {
+        if (id[i] == '-') ++i;
+        out.push_back(hex_value(id[i]) << 4 | hex_value(id[i + 1]));
+    }
+}
+
+static bool get_id(std::span<const uint8_t> data, size_t& offset, std::string& id) {
+    uint64_t header;
+    if (!get_varint(data, offset, header)) return false;
+    int kind = header & 3;
+    if (kind == ID_STRING) {
+        uint64_t length = header >> 2;
+        if (length > data.size() - offset) return false;
+        id.assign(data.begin() + offset, data.begin() + offset + length);
+        offset += length;
+        return true;
+    }
+    if (kind > ID_UUID_UPPER || header >> 2 || data.size() - offset < 16) return false;
+    const char* digits = kind == ID_UUID_UPPER ? "0123456789ABCDEF" : "0123456789abcdef";
+    id.clear();
+    for (size_t i = 0; i < 16; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) id += '-';
+        id += digits[data[offset + i] >> 4];
+        id += digits[data[offset + i] & 0x0F];
+    }
+    offset += 16;
+    return true;
+}
 
 class Messaging::Impl {
 public:
     static constexpr int MAX_RETRIES = 3;
     static constexpr int BASE_BACKOFF_MS = 500;
     static constexpr int ACK_TIMEOUT_MS = 5000;
+    static constexpr int ACK_DELAY_MS = 50;    // A standalone ACK waits this long for a message to ride on
+    static constexpr size_t MAX_AHEAD = 1024;  // Out-of-order sequences remembered per peer
+    static constexpr size_t MAX_BATCH_BYTES = 8 * 1024; // A batch this full goes out without waiting
+    static constexpr int HELLO_RETRY_MS = 5000; // An unanswered hello is repeated at most this often
+    static constexpr uint8_t HELLO_REPLY = 0x01;
+    static constexpr uint32_t MAX_NAMES = 1024; // Interned ids per peer, each way
+    // Compact frame flags
+    static constexpr uint8_t STATUS_MASK = 0x03;
+    static constexpr int RANGE_COUNT_SHIFT = 2; // Three bits
+    static constexpr uint8_t HAS_ACK = 0x20;
+    // Layout from before sequencing, recognised only to report the peer
+    static constexpr uint32_t LEGACY_ACK_MAGIC = 0x4D41434B; // 'MACK'
+    static constexpr size_t LEGACY_HEADER_SIZE = 33; // CRC, four id lengths, timestamp, content size, status
     uint32_t crc32_table[256];
     MessageCallback message_callback;
     std::function<bool(const std::string& device_id, const std::vector<uint8_t>& data)> bluetooth_sender;
-    std::queue<PendingMessage> pending_messages;
-    std::mutex queue_mutex;
-    std::condition_variable queue_cv;
+    std::function<void(const std::string& device_id, std::chrono::microseconds rtt)> rtt_callback;
+    std::unordered_map<std::string, PendingMessage> in_flight; // Sent and not yet ACKed, by message id
+
+    // Sequence state for one peer, in both directions
+    struct Peer {
+        uint32_t next_sequence = 1;
+        std::map<uint32_t, std::string> unacked; // Our sequence -> message id
+        uint32_t epoch = 0;        // The peer's current sequence space
+        uint32_t cumulative = 0;   // Every sequence of the peer's up to here has arrived
+        std::set<uint32_t> ahead;  // Arrived past a gap
+        bool ack_pending = false;  // Something arrived the peer hasn't been told about
+        uint64_t received = 0;     // Arrival count, so a piggybacked ACK can't cancel a newer one
+        std::chrono::steady_clock::time_point ack_due;
+
+        uint8_t version = 1;      // Frame version agreed in the hello exchange
+        uint32_t session = 0;     // Epoch of the peer's last hello, 0 before one arrived
+        std::chrono::steady_clock::time_point hello_due{}; // No hello of ours goes before this
+
+        // Ids we name by handle in compact frames to the peer. A handle goes
+        // alone only once a frame defining it was acknowledged, so loss and
+        // reordering can't leave the peer without it. Handles aren't reused.
+        struct Name {
+            uint32_t handle;
+            bool known = false; // The peer has it
+        };
+        std::unordered_map<std::string, Name> names_out;
+        std::map<uint32_t, std::vector<std::string>> defined_in; // Our sequence -> ids it defined
+        uint32_t next_handle = 1;
+        std::vector<std::string> names_in; // The peer's handles, for its epoch names_epoch
+        uint32_t names_epoch = 0;
+
+        bool legacy_reported = false; // Told the user once that the peer is too old
+    };
+    std::unordered_map<std::string, Peer> peers; // By device id
+    const uint32_t epoch = random_epoch();
+
+    // Messages waiting to go to one receiver together
+    struct Batch {
+        std::string sender_id;
+        uint32_t count = 0;
+        std::vector<uint8_t> frames; // Length-prefixed message frames, content in the clear
+        std::vector<std::string> message_ids;
+        std::chrono::steady_clock::time_point flush_at;
+    };
+    std::chrono::milliseconds batch_delay{0};
+    std::unordered_map<std::string, Batch> batches; // By receiver
+
+    // Next retry or ACK timeout of an in-flight message, or when a peer's
+    // delayed ACK is due. An ACK or reschedule leaves the old entry behind; it
+    // is skipped when it comes up.
+    enum class TimerKind { RETRY, ACK, BATCH };
+    struct Deadline {
+        std::chrono::steady_clock::time_point at;
+        TimerKind kind;
+        std::string key; // Message id for RETRY, device id for ACK and BATCH
+        bool operator>(const Deadline& other) const { return at > other.at; }
+    };
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+    std::mutex mutex;
+    std::condition_variable timer_cv;
     std::thread retry_thread;
     bool running = true;
-    std::unordered_map<std::string, PendingMessage> ack_waiting;
-    std::mutex ack_mutex;
     Crypto& crypto;
 
-    Impl(Crypto& c) : crypto(c), retry_thread(&Impl::retry_worker, this) {
+    Impl(Crypto& c) : crypto(c) {
         // Initialize CRC32 table
         for (uint32_t i = 0; i < 256; ++i) {
             uint32_t crc = i;
@@ -34,11 +200,16 @@ public:
             }
             crc32_table[i] = crc;
         }
+        // Last, once every member the worker touches is constructed
+        retry_thread = std::thread(&Impl::retry_worker, this);
     }
 
     ~Impl() {
-        running = false;
-        queue_cv.notify_one();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        timer_cv.notify_one();
         if (retry_thread.joinable()) retry_thread.join();
     }
 
@@ -50,64 +221,632 @@ public:
         return crc ^ 0xFFFFFFFF;
     }
 
+    static uint32_t random_epoch() {
+        std::random_device random;
+        uint32_t value;
+        do value = random(); while (value == 0);
+        return value;
+    }
+
+    // The rest are called with the mutex held
+    void schedule(TimerKind kind, const std::string& key, std::chrono::steady_clock::time_point at) {
+        bool earliest = deadlines.empty() || at < deadlines.top().at;
+        deadlines.push({at, kind, key});
+        if (earliest) timer_cv.notify_one();
+    }
+
+    void schedule(const PendingMessage& message) {
+        schedule(TimerKind::RETRY, message.id, message.next_retry);
+    }
+
+    SequenceAck build_ack(const Peer& peer) const {
+        SequenceAck ack;
+        ack.epoch = peer.epoch;
+        ack.cumulative = peer.cumulative;
+        for (uint32_t sequence : peer.ahead) {
+            if (!ack.ranges.empty() && ack.ranges.back().second + 1 == sequence) {
+                ack.ranges.back().second = sequence;
+            } else if (ack.ranges.size() < MAX_ACK_RANGES) {
+                ack.ranges.push_back({sequence, sequence});
+            } else {
+                break;
+            }
+        }
+        return ack;
+    }
+
+    // Records an arrival and returns false for a duplicate. floor lets the
+    // window skip sequences the sender has given up on.
+    bool note_received(const std::string& device_id, Peer& peer, const MessageSequencing& sequencing) {
+        if (sequencing.epoch != peer.epoch) {
+            peer.epoch = sequencing.epoch; // The sender restarted
+            peer.cumulative = 0;
+            peer.ahead.clear();
+        }
+        if (sequencing.floor > peer.cumulative + 1) {
+            peer.cumulative = sequencing.floor - 1;
+            peer.ahead.erase(peer.ahead.begin(), peer.ahead.upper_bound(peer.cumulative));
+        }
+
+        bool fresh = sequencing.sequence > peer.cumulative && !peer.ahead.count(sequencing.sequence);
+        if (fresh && sequencing.sequence != peer.cumulative + 1 && peer.ahead.size() >= MAX_AHEAD) {
+            return false; // Too far out of order to track; the sender will retransmit
+        }
+        if (fresh) {
+            peer.ahead.insert(sequencing.sequence);
+            while (!peer.ahead.empty() && *peer.ahead.begin() == peer.cumulative + 1) {
+                peer.cumulative = *peer.ahead.begin();
+                peer.ahead.erase(peer.ahead.begin());
+            }
+        }
+
+        // Duplicates are ACKed again, since the sender evidently missed the last one
+        ++peer.received;
+        if (!peer.ack_pending) {
+            peer.ack_pending = true;
+            peer.ack_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(ACK_DELAY_MS);
+            schedule(TimerKind::ACK, device_id, peer.ack_due);
+        }
+        return fresh;
+    }
+
+    // Retires every message the ACK covers. Returns the round trip of the
+    // newest one that went out only once, or -1 if there was none.
+    std::chrono::microseconds apply_ack(Peer& peer, const SequenceAck& ack) {
+        auto now = std::chrono::steady_clock::now();
+        auto newest = std::chrono::steady_clock::time_point::min();
+        auto retire = [&](std::map<uint32_t, std::string>::iterator it) {
+            auto message = in_flight.find(it->second);
+            if (message != in_flight.end()) {
+                if (message->second.retry_count == 0) newest = std::max(newest, message->second.sent_at);
+                in_flight.erase(message); // Its deadline is skipped when it comes up
+            }
+            auto names = peer.defined_in.find(it->first);
+            if (names != peer.defined_in.end()) {
+                for (const auto& value : names->second) {
+                    auto name = peer.names_out.find(value);
+                    if (name != peer.names_out.end()) name->second.known = true;
+                }
+                peer.defined_in.erase(names);
+            }
+            return peer.unacked.erase(it);
+        };
+        if (ack.epoch != epoch) return std::chrono::microseconds(-1); // For an earlier run of ours
+        for (auto it = peer.unacked.begin(); it != peer.unacked.end() && it->first <= ack.cumulative; ) {
+            it = retire(it);
+        }
+        for (const auto& [first, last] : ack.ranges) {
+            for (auto it = peer.unacked.lower_bound(first); it != peer.unacked.end() && it->first <= last; ) {
+                it = retire(it);
+            }
+        }
+        if (newest == std::chrono::steady_clock::time_point::min()) return std::chrono::microseconds(-1);
+        return std::chrono::duration_cast<std::chrono::microseconds>(now - newest);
+    }
+
+    static constexpr size_t CIPHER_OVERHEAD = 16; // AES-GCM tag; lets an encrypted frame fit its first allocation
+
+    // Appends a version 1 frame to out in one pass: the header with its sizes
+    // unset, the ids, the content (encrypted for receiver_id straight into out
+    // unless encrypt is false) and the ack ranges. content_size and the CRC
+    // are filled in once the rest is there.
+    bool build_message(std::vector<uint8_t>& out, const std::string& id, const std::string& conversation_id,
+                       const std::string& sender_id, const std::string& receiver_id,
+                       std::span<const uint8_t> content, bool encrypt, uint8_t status,
+                       const MessageSequencing& sequencing) {
+        size_t range_count = std::min(sequencing.ack.ranges.size(), MAX_ACK_RANGES);
+        MessageFrame frame;
+        frame.crc32 = 0;
+        frame.epoch = sequencing.epoch;
+        frame.sequence = sequencing.sequence;
+        frame.floor = sequencing.floor;
+        frame.ack.epoch = sequencing.ack.epoch;
+        frame.ack.cumulative = sequencing.ack.cumulative;
+        frame.ack.range_count = static_cast<uint8_t>(range_count);
+        frame.id_len = id.size();
+        frame.conversation_id_len = conversation_id.size();
+        frame.sender_id_len = sender_id.size();
+        frame.receiver_id_len = receiver_id.size();
+        frame.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        frame.content_size = 0;
+        frame.status = status;
+
+        size_t start = out.size();
+        out.reserve(start + sizeof(frame) + id.size() + conversation_id.size() + sender_id.size() + receiver_id.size() +
+                    content.size() + (encrypt ? CIPHER_OVERHEAD : 0) + range_count * 2 * sizeof(uint32_t));
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
+        out.insert(out.end(), id.begin(), id.end());
+        out.insert(out.end(), conversation_id.begin(), conversation_id.end());
+        out.insert(out.end(), sender_id.begin(), sender_id.end());
+        out.insert(out.end(), receiver_id.begin(), receiver_id.end());
+        size_t content_start = out.size();
+        if (!encrypt) {
+            out.insert(out.end(), content.begin(), content.end());
+        } else if (!crypto.encrypt_message(receiver_id, content.data(), content.size(), out)) {
+            out.resize(start);
+            return false;
+        }
+        frame.content_size = out.size() - content_start;
+        append_ack_ranges(out, sequencing.ack, range_count);
+
+        std::memcpy(out.data() + start + offsetof(MessageFrame, content_size), &frame.content_size, sizeof(frame.content_size));
+        frame.crc32 = crc32(out.data() + start + sizeof(frame.crc32), out.size() - start - sizeof(frame.crc32));
+        std::memcpy(out.data() + start, &frame.crc32, sizeof(frame.crc32));
+        return true;
+    }
+
+    // Checks a version 1 frame and points message at its parts
+    bool decode_message(std::span<const uint8_t> data, MessageView& message) {
+        if (data.size() < sizeof(MessageFrame)) return false;
+
+        MessageFrame frame;
+        std::memcpy(&frame, data.data(), sizeof(MessageFrame));
+        if (crc32(data.data() + sizeof(frame.crc32), data.size() - sizeof(frame.crc32)) != frame.crc32) return false;
+
+        size_t offset = sizeof(MessageFrame);
+        auto text = [&](uint32_t length, std::string_view& view) {
+            if (length > data.size() - offset) return false;
+            view = std::string_view(reinterpret_cast<const char*>(data.data()) + offset, length);
+            offset += length;
+            return true;
+        };
+        if (!text(frame.id_len, message.id) || !text(frame.conversation_id_len, message.conversation_id) ||
+            !text(frame.sender_id_len, message.sender_id) || !text(frame.receiver_id_len, message.receiver_id)) return false;
+
+        if (frame.content_size > data.size() - offset) return false;
+        message.content = data.subspan(offset, frame.content_size);
+        offset += frame.content_size;
+
+        if (!read_ack(frame.ack, data, offset, message.sequencing.ack)) return false;
+        message.sequencing.epoch = frame.epoch;
+        message.sequencing.sequence = frame.sequence;
+        message.sequencing.floor = frame.floor;
+        message.status = frame.status;
+        message.timestamp = frame.timestamp;
+        return true;
+    }
+
+    // How an id goes in a compact frame to peer: (handle << 1) alone once the
+    // peer has it, (handle << 1) | 1 followed by the id while it may not, or 0
+    // followed by the id when the table is full
+    uint32_t intern(Peer& peer, uint32_t sequence, const std::string& value) {
+        auto it = peer.names_out.find(value);
+        if (it == peer.names_out.end()) {
+            if (value.empty() || peer.names_out.size() >= MAX_NAMES) return 0;
+            it = peer.names_out.emplace(value, Peer::Name{peer.next_handle++}).first;
+        }
+        if (it->second.known) return it->second.handle << 1;
+        peer.defined_in[sequence].push_back(value);
+        return it->second.handle << 1 | 1;
+    }
+
+    // Takes a hello from the peer. Returns true if it wants a reply.
+    bool take_hello(Peer& peer, const HelloFrame& hello) {
+        bool reply = !(hello.flags & HELLO_REPLY);
+        if (reply || hello.epoch != peer.session) {
+            // A new session; it may have lost our names, so they are defined again
+            for (auto& [value, name] : peer.names_out) name.known = false;
+            peer.defined_in.clear();
+        }
+        peer.session = hello.epoch;
+        peer.version = std::min(FRAME_VERSION, hello.version);
+        return reply;
+    }
+
+    // Whether a hello of ours is due, and if so marks it sent
+    static bool hello_due(Peer& peer) {
+        auto now = std::chrono::steady_clock::now();
+        if (now < peer.hello_due) return false;
+        peer.hello_due = now + std::chrono::milliseconds(HELLO_RETRY_MS);
+        return true;
+    }
+
+    std::vector<uint8_t> encode_hello(bool reply) const {
+        HelloFrame frame;
+        frame.magic = HELLO_MAGIC;
+        frame.version = FRAME_VERSION;
+        frame.flags = reply ? HELLO_REPLY : 0;
+        frame.epoch = epoch;
+        return std::vector<uint8_t>(reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
+    }
+
+    static bool decode_hello(const std::vector<uint8_t>& data, HelloFrame& frame) {
+        if (data.size() != sizeof(HelloFrame)) return false;
+        std::memcpy(&frame, data.data(), sizeof(frame));
+        return frame.magic == HELLO_MAGIC && frame.version >= 1;
+    }
+
+    // Lays out a version 2 frame; names are the intern() codes of the
+    // conversation, sender and receiver ids
+    std::vector<uint8_t> encode_compact(const std::string& id, const std::string& conversation_id,
+                                        const std::string& sender_id, const std::string& receiver_id,
+                                        const std::vector<uint8_t>& payload, uint8_t status,
+                                        const MessageSequencing& sequencing, const std::array<uint32_t, 3>& names) {
+        size_t range_count = std::min(sequencing.ack.ranges.size(), MAX_ACK_RANGES);
+        CompactFrame frame;
+        frame.magic = COMPACT_MAGIC;
+        frame.crc32 = 0;
+        frame.epoch = sequencing.epoch;
+        frame.flags = (status & STATUS_MASK) | range_count << RANGE_COUNT_SHIFT | (sequencing.ack.epoch ? HAS_ACK : 0);
+
+        std::vector<uint8_t> buffer;
+        buffer.reserve(sizeof(frame) + 64 + conversation_id.size() + sender_id.size() + receiver_id.size() + payload.size());
+        buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
+        put_varint(buffer, sequencing.sequence);
+        put_varint(buffer, sequencing.sequence - sequencing.floor);
+        put_varint(buffer, std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        if (sequencing.ack.epoch) {
+            const auto* ack_epoch = reinterpret_cast<const uint8_t*>(&sequencing.ack.epoch);
+            buffer.insert(buffer.end(), ack_epoch, ack_epoch + sizeof(uint32_t));
+            put_varint(buffer, sequencing.ack.cumulative);
+            uint32_t previous = sequencing.ack.cumulative;
+            for (size_t i = 0; i < range_count; ++i) {
+                const auto& [first, last] = sequencing.ack.ranges[i];
+                put_varint(buffer, first - previous);
+                put_varint(buffer, last - first);
+                previous = last;
+            }
+        }
+        put_id(buffer, id);
+        const std::string* values[] = {&conversation_id, &sender_id, &receiver_id};
+        for (size_t i = 0; i < names.size(); ++i) {
+            put_varint(buffer, names[i]);
+            if (names[i] == 0 || names[i] & 1) put_id(buffer, *values[i]);
+        }
+        put_varint(buffer, payload.size());
+        buffer.insert(buffer.end(), payload.begin(), payload.end());
+
+        size_t covered = offsetof(CompactFrame, crc32) + sizeof(frame.crc32);
+        frame.crc32 = crc32(buffer.data() + covered, buffer.size() - covered);
+        std::memcpy(buffer.data() + offsetof(CompactFrame, crc32), &frame.crc32, sizeof(frame.crc32));
+        return buffer;
+    }
+
+    // Reads a version 2 frame from device_id, resolving its handles against
+    // what the peer has defined. The ids are spelled out into ids, which the
+    // views in message point at. unknown_name is set when it uses a handle we
+    // don't have, as after we restarted.
+    bool decode_compact(const std::string& device_id, std::span<const uint8_t> data, MessageView& message,
+                        std::array<std::string, 4>& ids, bool& unknown_name) {
+        if (data.size() < sizeof(CompactFrame)) return false;
+        CompactFrame frame;
+        std::memcpy(&frame, data.data(), sizeof(frame));
+        if (frame.magic != COMPACT_MAGIC) return false;
+        size_t covered = offsetof(CompactFrame, crc32) + sizeof(frame.crc32);
+        if (crc32(data.data() + covered, data.size() - covered) != frame.crc32) return false;
+
+        size_t offset = sizeof(frame);
+        MessageSequencing& sequencing = message.sequencing;
+        uint32_t back;
+        if (!get_varint32(data, offset, sequencing.sequence) || !get_varint32(data, offset, back) ||
+            back > sequencing.sequence || !get_varint(data, offset, message.timestamp)) return false;
+        sequencing.epoch = frame.epoch;
+        sequencing.floor = sequencing.sequence - back;
+        message.status = frame.flags & STATUS_MASK;
+
+        size_t range_count = frame.flags >> RANGE_COUNT_SHIFT & 0x07;
+        sequencing.ack = SequenceAck();
+        if (frame.flags & HAS_ACK) {
+            if (range_count > MAX_ACK_RANGES || data.size() - offset < sizeof(uint32_t)) return false;
+            std::memcpy(&sequencing.ack.epoch, data.data() + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+            if (!get_varint32(data, offset, sequencing.ack.cumulative)) return false;
+            uint64_t previous = sequencing.ack.cumulative;
+            for (size_t i = 0; i < range_count; ++i) {
+                uint64_t gap, length;
+                if (!get_varint(data, offset, gap) || !get_varint(data, offset, length)) return false;
+                if (gap > UINT32_MAX || length > UINT32_MAX || previous + gap + length > UINT32_MAX) return false;
+                sequencing.ack.ranges.push_back({static_cast<uint32_t>(previous + gap), static_cast<uint32_t>(previous + gap + length)});
+                previous += gap + length;
+            }
+        } else if (range_count) {
+            return false;
+        }
+
+        if (!get_id(data, offset, ids[0])) return false;
+        std::array<uint32_t, 3> names;
+        std::string* values[] = {&ids[1], &ids[2], &ids[3]};
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (!get_varint32(data, offset, names[i]) || names[i] >> 1 > MAX_NAMES) return false;
+            if (names[i] == 0 || names[i] & 1) {
+                if (!get_id(data, offset, *values[i])) return false;
+            }
+        }
+        uint64_t content_size;
+        if (!get_varint(data, offset, content_size) || content_size != data.size() - offset) return false;
+        message.content = data.subspan(offset);
+
+        // Definitions first, since one frame may define and use a handle
+        std::lock_guard<std::mutex> lock(mutex);
+        Peer& peer = peers[device_id];
+        if (frame.epoch != peer.names_epoch) {
+            peer.names_in.clear(); // The sender restarted and numbers afresh
+            peer.names_epoch = frame.epoch;
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (!(names[i] & 1)) continue;
+            uint32_t handle = names[i] >> 1;
+            if (peer.names_in.size() <= handle) peer.names_in.resize(handle + 1);
+            peer.names_in[handle] = *values[i];
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == 0 || names[i] & 1) continue;
+            uint32_t handle = names[i] >> 1;
+            if (handle >= peer.names_in.size() || peer.names_in[handle].empty()) {
+                unknown_name = hello_due(peer); // Our hello makes the sender define its names again
+                return false;
+            }
+            *values[i] = peer.names_in[handle];
+        }
+        message.id = ids[0];
+        message.conversation_id = ids[1];
+        message.sender_id = ids[2];
+        message.receiver_id = ids[3];
+        return true;
+    }
+
+    // Either frame version as views into data, content left as it came. A
+    // compact frame's ids are spelled out into ids and viewed there.
+    bool decode_frame(const std::string& device_id, std::span<const uint8_t> data, MessageView& message,
+                      std::array<std::string, 4>& ids, bool& unknown_name) {
+        uint32_t magic = 0;
+        if (data.size() >= sizeof(magic)) std::memcpy(&magic, data.data(), sizeof(magic));
+        if (magic == COMPACT_MAGIC) {
+            return decode_compact(device_id, data, message, ids, unknown_name);
+        }
+        return decode_message(data, message);
+    }
+
+    // A frame or ACK in the layout peers used before sequencing: a 'MACK' with
+    // exactly its message id, or a frame holding exactly the ids and content its
+    // header announces under an intact CRC
+    bool is_legacy(const std::vector<uint8_t>& data) {
+        auto field = [&](size_t offset) {
+            uint32_t value;
+            std::memcpy(&value, data.data() + offset, sizeof(value));
+            return value;
+        };
+        if (data.size() >= 2 * sizeof(uint32_t) && field(0) == LEGACY_ACK_MAGIC &&
+            2 * sizeof(uint32_t) + static_cast<uint64_t>(field(4)) == data.size()) {
+            return true;
+        }
+        if (data.size() < LEGACY_HEADER_SIZE) return false;
+        uint64_t size = LEGACY_HEADER_SIZE;
+        for (size_t offset : {4, 8, 12, 16, 28}) size += field(offset); // The four id lengths and the content size
+        return size == data.size() && crc32(data.data() + sizeof(uint32_t), data.size() - sizeof(uint32_t)) == field(0);
+    }
+
+    static void append_batched(std::vector<uint8_t>& frames, const std::vector<uint8_t>& frame) {
+        uint32_t length = frame.size();
+        frames.insert(frames.end(), reinterpret_cast<uint8_t*>(&length), reinterpret_cast<uint8_t*>(&length) + sizeof(length));
+        frames.insert(frames.end(), frame.begin(), frame.end());
+    }
+
+    // One encryption, and one header and CRC, for the whole batch
+    std::vector<uint8_t> encode_batch(const std::string& receiver_id, const std::string& sender_id,
+                                      uint32_t count, const std::vector<uint8_t>& frames) {
+        auto encrypted = crypto.encrypt_message(receiver_id, frames);
+        BatchFrame frame;
+        frame.magic = BATCH_MAGIC;
+        frame.crc32 = 0;
+        frame.sender_id_len = sender_id.size();
+        frame.count = count;
+        frame.content_size = encrypted.size();
+        std::vector<uint8_t> buffer(reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
+        buffer.insert(buffer.end(), sender_id.begin(), sender_id.end());
+        buffer.insert(buffer.end(), encrypted.begin(), encrypted.end());
+        size_t covered = offsetof(BatchFrame, crc32) + sizeof(frame.crc32);
+        frame.crc32 = crc32(buffer.data() + covered, buffer.size() - covered);
+        std::memcpy(buffer.data() + offsetof(BatchFrame, crc32), &frame.crc32, sizeof(frame.crc32));
+        return buffer;
+    }
+
+    // Returns false unless data is an intact batch. plain receives the
+    // decrypted messages and frames points at each of them there.
+    bool decode_batch(const std::vector<uint8_t>& data, std::vector<uint8_t>& plain, std::vector<std::span<const uint8_t>>& frames) {
+        if (data.size() < sizeof(BatchFrame)) return false;
+        BatchFrame frame;
+        std::memcpy(&frame, data.data(), sizeof(frame));
+        if (frame.magic != BATCH_MAGIC) return false;
+        if (sizeof(frame) + static_cast<uint64_t>(frame.sender_id_len) + frame.content_size != data.size()) return false;
+        size_t covered = offsetof(BatchFrame, crc32) + sizeof(frame.crc32);
+        if (crc32(data.data() + covered, data.size() - covered) != frame.crc32) return false;
+
+        std::string sender_id(data.begin() + sizeof(frame), data.begin() + sizeof(frame) + frame.sender_id_len);
+        const uint8_t* encrypted = data.data() + sizeof(frame) + frame.sender_id_len;
+        if (!crypto.decrypt_message(sender_id, encrypted, frame.content_size, plain)) return false;
+        size_t offset = 0;
+        for (uint32_t i = 0; i < frame.count; ++i) {
+            uint32_t length;
+            if (offset + sizeof(length) > plain.size()) return false;
+            std::memcpy(&length, plain.data() + offset, sizeof(length));
+            offset += sizeof(length);
+            if (length > plain.size() - offset) return false;
+            frames.push_back(std::span<const uint8_t>(plain).subspan(offset, length));
+            offset += length;
+        }
+        return offset == plain.size();
+    }
+
+    // Sends what is waiting for receiver_id; releases the lock while it does
+    void flush_batch(const std::string& receiver_id, std::unique_lock<std::mutex>& lock) {
+        auto it = batches.find(receiver_id);
+        if (it == batches.end()) return;
+        Batch batch = std::move(it->second);
+        batches.erase(it);
+        lock.unlock();
+        auto data = encode_batch(receiver_id, batch.sender_id, batch.count, batch.frames);
+        bool sent = bluetooth_sender && bluetooth_sender(receiver_id, data);
+        lock.lock();
+        if (!sent) return; // The retry timers resend them one by one
+        auto now = std::chrono::steady_clock::now();
+        for (const auto& id : batch.message_ids) {
+            auto message = in_flight.find(id);
+            if (message != in_flight.end() && message->second.retry_count == 0) message->second.sent_at = now;
+        }
+    }
+
+    void append_to_batch(const PendingMessage& message, const std::vector<uint8_t>& frame, std::unique_lock<std::mutex>& lock) {
+        auto it = batches.find(message.receiver_id);
+        if (it != batches.end() && (it->second.sender_id != message.sender_id ||
+                                    it->second.frames.size() + sizeof(uint32_t) + frame.size() > MAX_BATCH_BYTES)) {
+            flush_batch(message.receiver_id, lock); // Make room
+            it = batches.find(message.receiver_id);
+        }
+        if (it == batches.end()) {
+            it = batches.emplace(message.receiver_id, Batch()).first;
+            it->second.sender_id = message.sender_id;
+            it->second.flush_at = std::chrono::steady_clock::now() + batch_delay;
+            schedule(TimerKind::BATCH, message.receiver_id, it->second.flush_at);
+        }
+        Batch& batch = it->second;
+        append_batched(batch.frames, frame);
+        batch.message_ids.push_back(message.id);
+        ++batch.count;
+        if (batch.frames.size() >= MAX_BATCH_BYTES) flush_batch(message.receiver_id, lock);
+    }
+
+    // Takes a received message's piggybacked ACK and notes its arrival.
+    // Returns false for a duplicate, which isn't handed on.
+    bool accept_message(const std::string& device_id, const MessageSequencing& sequencing) {
+        bool fresh;
+        std::chrono::microseconds rtt;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Peer& peer = peers[device_id];
+            rtt = apply_ack(peer, sequencing.ack);
+            fresh = note_received(device_id, peer, sequencing);
+        }
+        if (rtt.count() >= 0 && rtt_callback) {
+            rtt_callback(device_id, rtt);
+        }
+        return fresh;
+    }
+
+    // The callback takes owning strings, so a message's ids are copied only
+    // here, once it is known to be new
+    void deliver(const MessageView& message, const std::vector<uint8_t>& content) {
+        if (!message_callback) return;
+        message_callback(std::string(message.id), std::string(message.conversation_id), std::string(message.sender_id),
+                         std::string(message.receiver_id), content, static_cast<MessageStatus>(message.status));
+    }
+
+    static void append_ack_ranges(std::vector<uint8_t>& buffer, const SequenceAck& ack, size_t count) {
+        for (const auto& range : std::span(ack.ranges).first(count)) {
+            buffer.insert(buffer.end(), reinterpret_cast<const uint8_t*>(&range.first), reinterpret_cast<const uint8_t*>(&range.first) + sizeof(uint32_t));
+            buffer.insert(buffer.end(), reinterpret_cast<const uint8_t*>(&range.second), reinterpret_cast<const uint8_t*>(&range.second) + sizeof(uint32_t));
+        }
+    }
+
+    static bool read_ack(const AckHeader& header, std::span<const uint8_t> data, size_t offset, SequenceAck& ack) {
+        if (header.range_count > MAX_ACK_RANGES) return false;
+        if (offset + header.range_count * 2 * sizeof(uint32_t) != data.size()) return false;
+        ack.epoch = header.epoch;
+        ack.cumulative = header.cumulative;
+        ack.ranges.resize(header.range_count);
+        for (auto& range : ack.ranges) {
+            std::memcpy(&range.first, data.data() + offset, sizeof(uint32_t));
+            std::memcpy(&range.second, data.data() + offset + sizeof(uint32_t), sizeof(uint32_t));
+            offset += 2 * sizeof(uint32_t);
+        }
+        return true;
+    }
+
+    static std::vector<uint8_t> encode_ack(const SequenceAck& ack) {
+        AckFrame frame;
+        frame.magic = MAGIC;
+        frame.ack.epoch = ack.epoch;
+        frame.ack.cumulative = ack.cumulative;
+        frame.ack.range_count = static_cast<uint8_t>(ack.ranges.size());
+        std::vector<uint8_t> buffer(reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
+        append_ack_ranges(buffer, ack, ack.ranges.size());
+        return buffer;
+    }
+
+    // Sleeps until the earliest deadline rather than polling, so an idle
+    // messenger never wakes and a burst of timeouts all fire on time
     void retry_worker() {
+        std::unique_lock<std::mutex> lock(mutex);
         while (running) {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            queue_cv.wait_for(lock, std::chrono::milliseconds(2000), [this]() { return !running; }); // Reduce frequency for low power
-            if (!running) break;
-
+            if (deadlines.empty()) {
+                timer_cv.wait(lock);
+                continue;
+            }
             auto now = std::chrono::steady_clock::now();
-
-            // Handle pending retries (limit to 5 per cycle to reduce CPU)
-            int processed = 0;
-            while (!pending_messages.empty() && pending_messages.front().next_retry <= now && processed < 5) {
-                PendingMessage msg = pending_messages.front();
-                pending_messages.pop();
+            auto next = deadlines.top().at; // A copy: the heap may reallocate while we wait
+            if (next > now) {
+                timer_cv.wait_until(lock, next);
+                continue;
+            }
+            Deadline deadline = deadlines.top();
+            deadlines.pop();
+            if (deadline.kind == TimerKind::ACK) {
+                auto peer = peers.find(deadline.key);
+                if (peer == peers.end() || !peer->second.ack_pending || peer->second.ack_due != deadline.at) continue; // Piggybacked
+                peer->second.ack_pending = false;
+                auto ack_data = encode_ack(build_ack(peer->second));
                 lock.unlock();
-
-                if (msg.retry_count < Impl::MAX_RETRIES) {
-                    if (bluetooth_sender && bluetooth_sender(msg.receiver_id, msg.data)) {
-                        msg.retry_count++;
-                        msg.next_retry = now + std::chrono::milliseconds(Impl::BASE_BACKOFF_MS * (1 << msg.retry_count));
-                        lock.lock();
-                        pending_messages.push(msg);
-                        lock.unlock();
-                    } else {
-                        msg.retry_count++;
-                        if (msg.retry_count < Impl::MAX_RETRIES) {
-                            msg.next_retry = now + std::chrono::milliseconds(Impl::BASE_BACKOFF_MS * (1 << msg.retry_count));
-                            lock.lock();
-                            pending_messages.push(msg);
-                            lock.unlock();
-                        } else {
-                            if (message_callback) {
-                                message_callback(msg.id, "", "", msg.receiver_id, {}, MessageStatus::SENT);
-                            }
-                        }
-                    }
-                } else {
-                    if (message_callback) {
-                        message_callback(msg.id, "", "", msg.receiver_id, {}, MessageStatus::SENT);
-                    }
+                if (bluetooth_sender) {
+                    bluetooth_sender(deadline.key, ack_data);
                 }
                 lock.lock();
-                processed++;
+                continue;
             }
+            if (deadline.kind == TimerKind::BATCH) {
+                auto batch = batches.find(deadline.key);
+                if (batch != batches.end() && batch->second.flush_at == deadline.at) flush_batch(deadline.key, lock);
+                continue;
+            }
+            auto it = in_flight.find(deadline.key);
+            if (it == in_flight.end() || it->second.next_retry != deadline.at) continue; // ACKed or rescheduled
 
-            // Check ack timeouts (limit iterations)
-            int ack_processed = 0;
-            for (auto it = ack_waiting.begin(); it != ack_waiting.end() && ack_processed < 10; ) {
-                if (it->second.next_retry <= now) {
-                    pending_messages.push(it->second);
-                    it = ack_waiting.erase(it);
-                } else {
-                    ++it;
+            PendingMessage& msg = it->second;
+            if (msg.retry_count >= MAX_RETRIES) {
+                std::string id = msg.id;
+                std::string receiver_id = msg.receiver_id;
+                auto peer = peers.find(receiver_id);
+                if (peer != peers.end()) {
+                    peer->second.unacked.erase(msg.sequence); // The floor moves past it
+                    peer->second.defined_in.erase(msg.sequence);
+                }
+                in_flight.erase(it);
+                lock.unlock();
+                if (message_callback) {
+                    message_callback(id, "", "", receiver_id, {}, MessageStatus::SENT);
                 }
-                ack_processed++;
+                lock.lock();
+                continue;
             }
 
+            // A failed send counts as an attempt too; the backoff doubles either way
+            msg.retry_count++;
+            msg.next_retry = now + std::chrono::milliseconds(BASE_BACKOFF_MS * (1 << msg.retry_count));
+            schedule(msg);
+            std::string receiver_id = msg.receiver_id;
+            std::string sender_id = msg.sender_id;
+            std::vector<uint8_t> data = msg.data;
+            bool batched = msg.batched;
+            if (msg.compact) {
+                Peer& peer = peers[receiver_id];
+                MessageSequencing sequencing{epoch, msg.sequence, peer.unacked.begin()->first, build_ack(peer)};
+                std::array<uint32_t, 3> names = {intern(peer, msg.sequence, msg.conversation_id),
+                                                 intern(peer, msg.sequence, sender_id),
+                                                 intern(peer, msg.sequence, receiver_id)};
+                data = encode_compact(msg.id, msg.conversation_id, sender_id, receiver_id, msg.content, msg.status, sequencing, names);
+            }
             lock.unlock();
-            std::this_thread::sleep_for(std::chrono::milliseconds(10)); // Yield CPU
+            if (batched) {
+                // Goes again as a batch of one, since its content was never encrypted on its own
+                std::vector<uint8_t> frames;
+                append_batched(frames, data);
+                data = encode_batch(receiver_id, sender_id, 1, frames);
+            }
+            if (bluetooth_sender) {
+                bluetooth_sender(receiver_id, data);
+            }
+            lock.lock();
         }
     }
 };
@@ -123,115 +862,139 @@ void Messaging::set_bluetooth_sender(std::function<bool(const std::string& devic
     pimpl->bluetooth_sender = sender;
 }
 
+void Messaging::set_rtt_callback(std::function<void(const std::string& device_id, std::chrono::microseconds rtt)> callback) {
+    pimpl->rtt_callback = callback;
+}
+
+void Messaging::set_batch_delay(std::chrono::milliseconds max_delay) {
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    pimpl->batch_delay = max_delay;
+}
+
 std::vector<uint8_t> Messaging::pack_message(const std::string& id, const std::string& conversation_id,
                                               const std::string& sender_id, const std::string& receiver_id,
-                                              const std::vector<uint8_t>& content, uint8_t status) {
+                                              const std::vector<uint8_t>& content, uint8_t status,
+                                              const MessageSequencing& sequencing) {
     std::vector<uint8_t> buffer;
-
-    // Encrypt content
-    auto encrypted_content = pimpl->crypto.encrypt_message(receiver_id, content);
-
-    // Calculate sizes
-    uint32_t id_len = id.size();
-    uint32_t conv_len = conversation_id.size();
-    uint32_t sender_len = sender_id.size();
-    uint32_t receiver_len = receiver_id.size();
-    uint32_t content_size = encrypted_content.size();
-    uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count();
-
-    // Create frame header
-    MessageFrame frame;
-    frame.id_len = id_len;
-    frame.conversation_id_len = conv_len;
-    frame.sender_id_len = sender_len;
-    frame.receiver_id_len = receiver_len;
-    frame.timestamp = timestamp;
-    frame.content_size = content_size;
-    frame.status = status;
-
-    // Calculate CRC32 over the data part
-    std::vector<uint8_t> data_part;
-    data_part.insert(data_part.end(), reinterpret_cast<uint8_t*>(&frame.id_len), reinterpret_cast<uint8_t*>(&frame.id_len) + sizeof(frame) - sizeof(frame.crc32));
-    data_part.insert(data_part.end(), id.begin(), id.end());
-    data_part.insert(data_part.end(), conversation_id.begin(), conversation_id.end());
-    data_part.insert(data_part.end(), sender_id.begin(), sender_id.end());
-    data_part.insert(data_part.end(), receiver_id.begin(), receiver_id.end());
-    data_part.insert(data_part.end(), encrypted_content.begin(), encrypted_content.end());
-
-    frame.crc32 = pimpl->crc32(data_part.data(), data_part.size());
-
-    // Pack into buffer
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&frame), reinterpret_cast<uint8_t*>(&frame) + sizeof(frame));
-    buffer.insert(buffer.end(), id.begin(), id.end());
-    buffer.insert(buffer.end(), conversation_id.begin(), conversation_id.end());
-    buffer.insert(buffer.end(), sender_id.begin(), sender_id.end());
-    buffer.insert(buffer.end(), receiver_id.begin(), receiver_id.end());
-    buffer.insert(buffer.end(), encrypted_content.begin(), encrypted_content.end());
-
+    pimpl->build_message(buffer, id, conversation_id, sender_id, receiver_id, content, true, status, sequencing);
     return buffer;
 }
 
+bool Messaging::pack_message(const std::string& id, const std::string& conversation_id,
+                             const std::string& sender_id, const std::string& receiver_id,
+                             std::span<const uint8_t> content, uint8_t status,
+                             const MessageSequencing& sequencing, std::vector<uint8_t>& out) {
+    return pimpl->build_message(out, id, conversation_id, sender_id, receiver_id, content, true, status, sequencing);
+}
+
 bool Messaging::unpack_message(const std::vector<uint8_t>& data, std::string& id, std::string& conversation_id,
                                 std::string& sender_id, std::string& receiver_id,
-                                std::vector<uint8_t>& content, uint8_t& status, uint64_t& timestamp) {
-    if (data.size() < sizeof(MessageFrame)) return false;
-
-    MessageFrame frame;
-    std::memcpy(&frame, data.data(), sizeof(MessageFrame));
-
-    size_t offset = sizeof(MessageFrame);
-
-    if (offset + frame.id_len > data.size()) return false;
-    id.assign(data.begin() + offset, data.begin() + offset + frame.id_len);
-    offset += frame.id_len;
-
-    if (offset + frame.conversation_id_len > data.size()) return false;
-    conversation_id.assign(data.begin() + offset, data.begin() + offset + frame.conversation_id_len);
-    offset += frame.conversation_id_len;
-
-    if (offset + frame.sender_id_len > data.size()) return false;
-    sender_id.assign(data.begin() + offset, data.begin() + offset + frame.sender_id_len);
-    offset += frame.sender_id_len;
-
-    if (offset + frame.receiver_id_len > data.size()) return false;
-    receiver_id.assign(data.begin() + offset, data.begin() + offset + frame.receiver_id_len);
-    offset += frame.receiver_id_len;
-
-    if (offset + frame.content_size > data.size()) return false;
-    std::vector<uint8_t> encrypted_content(data.begin() + offset, data.begin() + offset + frame.content_size);
-
-    status = frame.status;
-    timestamp = frame.timestamp;
-
-    // Verify CRC32
-    std::vector<uint8_t> data_part(data.begin() + sizeof(uint32_t), data.end());
-    uint32_t calculated_crc = pimpl->crc32(data_part.data(), data_part.size());
-    if (calculated_crc != frame.crc32) return false;
-
-    // Decrypt content
-    content = pimpl->crypto.decrypt_message(sender_id, encrypted_content);
+                                std::vector<uint8_t>& content, uint8_t& status, uint64_t& timestamp,
+                                MessageSequencing& sequencing) {
+    MessageView message;
+    if (!pimpl->decode_message(data, message)) return false;
+    id = message.id;
+    conversation_id = message.conversation_id;
+    sender_id = message.sender_id;
+    receiver_id = message.receiver_id;
+    status = message.status;
+    timestamp = message.timestamp;
+    sequencing = std::move(message.sequencing);
+    content.clear(); // Left empty if it won't decrypt
+    pimpl->crypto.decrypt_message(sender_id, message.content.data(), message.content.size(), content);
     return true;
 }
 
-
+bool Messaging::unpack_message(std::span<const uint8_t> data, MessageView& message) {
+    return pimpl->decode_message(data, message);
+}
 
 bool Messaging::send_message(const std::string& id, const std::string& conversation_id,
                              const std::string& sender_id, const std::string& receiver_id,
                              const std::vector<uint8_t>& content, MessageStatus status) {
     try {
-        auto data = pack_message(id, conversation_id, sender_id, receiver_id, content, static_cast<uint8_t>(status));
-        if (data.empty()) {
-            // Packing failed
-            return false;
+        // Takes the next sequence and carries whatever ACK is owed to the receiver
+        MessageSequencing sequencing;
+        uint64_t received;
+        bool batching;
+        bool compact;
+        bool hello;
+        std::array<uint32_t, 3> names;
+        {
+            std::lock_guard<std::mutex> lock(pimpl->mutex);
+            Impl::Peer& peer = pimpl->peers[receiver_id];
+            sequencing.epoch = pimpl->epoch;
+            sequencing.sequence = peer.next_sequence++;
+            peer.unacked[sequencing.sequence] = id;
+            sequencing.floor = peer.unacked.begin()->first;
+            sequencing.ack = pimpl->build_ack(peer);
+            received = peer.received;
+            batching = pimpl->batch_delay.count() > 0;
+            compact = peer.version >= 2;
+            if (compact) {
+                names = {pimpl->intern(peer, sequencing.sequence, conversation_id),
+                         pimpl->intern(peer, sequencing.sequence, sender_id),
+                         pimpl->intern(peer, sequencing.sequence, receiver_id)};
+            }
+            hello = peer.session == 0 && Impl::hello_due(peer); // Until the peer has told us what it speaks
+        }
+        if (hello && pimpl->bluetooth_sender) {
+            pimpl->bluetooth_sender(receiver_id, pimpl->encode_hello(false));
         }
-        if (pimpl->bluetooth_sender && pimpl->bluetooth_sender(receiver_id, data)) {
-            PendingMessage pm{id, data, receiver_id, 0, std::chrono::steady_clock::now() + std::chrono::milliseconds(Impl::ACK_TIMEOUT_MS)};
-            std::lock_guard<std::mutex> lock(pimpl->ack_mutex);
-            pimpl->ack_waiting[id] = pm;
+
+        if (batching) {
+            // Encrypted later with the rest of its batch
+            std::vector<uint8_t> frame;
+            if (compact) {
+                frame = pimpl->encode_compact(id, conversation_id, sender_id, receiver_id, content, static_cast<uint8_t>(status), sequencing, names);
+            } else {
+                pimpl->build_message(frame, id, conversation_id, sender_id, receiver_id, content, false, static_cast<uint8_t>(status), sequencing);
+            }
+            std::unique_lock<std::mutex> lock(pimpl->mutex);
+            auto now = std::chrono::steady_clock::now();
+            PendingMessage pm{id, {}, receiver_id, 0, now + std::chrono::milliseconds(Impl::ACK_TIMEOUT_MS), now, sequencing.sequence, sender_id, true,
+                              compact, conversation_id, {}, static_cast<uint8_t>(status)};
+            if (compact) {
+                pm.content = content;
+            } else {
+                pm.data = frame;
+            }
+            pimpl->in_flight[id] = pm;
+            pimpl->schedule(pm);
+            pimpl->append_to_batch(pm, frame, lock);
             return true;
         }
-        return false;
+
+        // A version 1 frame takes its ciphertext in place; a compact one keeps it for retries
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> encrypted_content;
+        if (compact) {
+            encrypted_content = pimpl->crypto.encrypt_message(receiver_id, content);
+            data = pimpl->encode_compact(id, conversation_id, sender_id, receiver_id, encrypted_content, static_cast<uint8_t>(status), sequencing, names);
+        } else {
+            pimpl->build_message(data, id, conversation_id, sender_id, receiver_id, content, true, static_cast<uint8_t>(status), sequencing);
+        }
+        bool sent = !data.empty() && pimpl->bluetooth_sender && pimpl->bluetooth_sender(receiver_id, data);
+
+        std::lock_guard<std::mutex> lock(pimpl->mutex);
+        Impl::Peer& peer = pimpl->peers[receiver_id];
+        if (!sent) {
+            peer.unacked.erase(sequencing.sequence);
+            peer.defined_in.erase(sequencing.sequence);
+            return false;
+        }
+        if (peer.received == received) peer.ack_pending = false; // The delayed ACK is skipped
+        auto now = std::chrono::steady_clock::now();
+        PendingMessage pm{id, {}, receiver_id, 0, now + std::chrono::milliseconds(Impl::ACK_TIMEOUT_MS), now, sequencing.sequence, sender_id, false,
+                          compact, conversation_id, {}, static_cast<uint8_t>(status)};
+        if (compact) {
+            pm.content = std::move(encrypted_content);
+        } else {
+            pm.data = std::move(data);
+        }
+        pimpl->schedule(pm);
+        pimpl->in_flight[id] = std::move(pm);
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Error sending message: " << e.what() << std::endl;
         return false;
@@ -239,51 +1002,79 @@ bool Messaging::send_message(const std::string& id, const std::string& conversat
 }
 
 void Messaging::receive_data(const std::string& sender_id, const std::vector<uint8_t>& data) {
-    // Check if it's an ACK
-    std::string ack_message_id;
-    if (unpack_ack(data, ack_message_id)) {
-        std::lock_guard<std::mutex> lock(pimpl->ack_mutex);
-        pimpl->ack_waiting.erase(ack_message_id);
+    HelloFrame hello;
+    if (Impl::decode_hello(data, hello)) {
+        bool reply;
+        {
+            std::lock_guard<std::mutex> lock(pimpl->mutex);
+            reply = pimpl->take_hello(pimpl->peers[sender_id], hello);
+        }
+        if (reply && pimpl->bluetooth_sender) {
+            pimpl->bluetooth_sender(sender_id, pimpl->encode_hello(true));
+        }
         return;
     }
 
-    // Otherwise, it's a message
-    std::string id, conversation_id, sender, receiver;
-    std::vector<uint8_t> content;
-    uint8_t status;
-    uint64_t timestamp;
-    if (unpack_message(data, id, conversation_id, sender, receiver, content, status, timestamp)) {
-        if (pimpl->message_callback) {
-            pimpl->message_callback(id, conversation_id, sender, receiver, content, static_cast<MessageStatus>(status));
+    // Check if it's a standalone ACK
+    SequenceAck ack;
+    if (unpack_ack(data, ack)) {
+        std::chrono::microseconds rtt;
+        {
+            std::lock_guard<std::mutex> lock(pimpl->mutex);
+            rtt = pimpl->apply_ack(pimpl->peers[sender_id], ack);
         }
-        // Send ACK
-        auto ack_data = pack_ack(id);
-        if (pimpl->bluetooth_sender) {
-            pimpl->bluetooth_sender(sender_id, ack_data);
+        if (rtt.count() >= 0 && pimpl->rtt_callback) {
+            pimpl->rtt_callback(sender_id, rtt);
         }
+        return;
+    }
+
+    // A batch of messages, or a single message; either may carry an ACK.
+    // Frames are read in place; only new messages are copied out for the callback.
+    bool unknown_name = false;
+    std::vector<uint8_t> plain;
+    std::vector<std::span<const uint8_t>> frames;
+    MessageView message;
+    std::array<std::string, 4> ids;
+    if (pimpl->decode_batch(data, plain, frames)) {
+        for (auto frame : frames) {
+            if (pimpl->decode_frame(sender_id, frame, message, ids, unknown_name) &&
+                pimpl->accept_message(sender_id, message.sequencing)) {
+                pimpl->deliver(message, std::vector<uint8_t>(message.content.begin(), message.content.end()));
+            }
+        }
+    } else if (pimpl->decode_frame(sender_id, data, message, ids, unknown_name)) {
+        if (pimpl->accept_message(sender_id, message.sequencing)) {
+            std::vector<uint8_t> content; // Left empty if it won't decrypt
+            pimpl->crypto.decrypt_message(std::string(message.sender_id), message.content.data(), message.content.size(), content);
+            pimpl->deliver(message, content);
+        }
+    } else if (!unknown_name && pimpl->is_legacy(data)) {
+        bool report;
+        {
+            std::lock_guard<std::mutex> lock(pimpl->mutex);
+            Impl::Peer& peer = pimpl->peers[sender_id];
+            report = !peer.legacy_reported;
+            peer.legacy_reported = true;
+        }
+        if (report) {
+            std::cerr << "Peer " << sender_id << " uses the message format from before sequenced ACKs; "
+                      << "its messages can't be read until it is updated" << std::endl;
+        }
+    }
+    if (unknown_name && pimpl->bluetooth_sender) {
+        pimpl->bluetooth_sender(sender_id, pimpl->encode_hello(false));
     }
 }
 
-std::vector<uint8_t> Messaging::pack_ack(const std::string& message_id) {
-    std::vector<uint8_t> buffer;
-    uint32_t magic = MAGIC;
-    uint32_t id_len = message_id.size();
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&magic), reinterpret_cast<uint8_t*>(&magic) + sizeof(magic));
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&id_len), reinterpret_cast<uint8_t*>(&id_len) + sizeof(id_len));
-    buffer.insert(buffer.end(), message_id.begin(), message_id.end());
-    return buffer;
+std::vector<uint8_t> Messaging::pack_ack(const SequenceAck& ack) {
+    return Impl::encode_ack(ack);
 }
 
-bool Messaging::unpack_ack(const std::vector<uint8_t>& data, std::string& message_id) {
-    if (data.size() < sizeof(uint32_t) * 2) return false;
-    uint32_t magic, id_len;
-    size_t offset = 0;
-    std::memcpy(&magic, data.data() + offset, sizeof(magic));
-    offset += sizeof(magic);
-    if (magic != MAGIC) return false;
-    std::memcpy(&id_len, data.data() + offset, sizeof(id_len));
-    offset += sizeof(id_len);
-    if (offset + id_len != data.size()) return false;
-    message_id.assign(data.begin() + offset, data.end());
-    return true;
-}
\ No newline at end of file
+bool Messaging::unpack_ack(const std::vector<uint8_t>& data, SequenceAck& ack) {
+    if (data.size() < sizeof(AckFrame)) return false;
+    AckFrame frame;
+    std::memcpy(&frame, data.data(), sizeof(frame));
+    if (frame.magic != MAGIC) return false;
+    return Impl::read_ack(frame.ack, data, sizeof(frame), ack);
+}
@@ -10,10 +10,27 @@
 #include <unordered_map>
 #include <functional>
 #include <chrono>
+#include <span>
+#include <string_view>
 
 #pragma pack(push, 1)
+// What a peer has received of our sequence space
+struct AckHeader {
+    uint32_t epoch;      // The epoch acknowledged, 0 before anything arrived
+    uint32_t cumulative; // Every sequence up to this one has arrived
+    uint8_t range_count; // Followed by this many [first, last] pairs received past it
+};
+
+// Version 1 message frame, spoken before any hello. It replaced the original
+// unsequenced frame and its 'MACK' per-message ACKs without a version marker,
+// so it is a wire break: peers from before sequencing can't exchange messages
+// with this one. Their traffic is only recognised, to report them as too old.
 struct MessageFrame {
     uint32_t crc32;
+    uint32_t epoch;      // Random per sender instance, so a restart starts a fresh sequence space
+    uint32_t sequence;   // Per peer, from 1
+    uint32_t floor;      // Lowest sequence still unacknowledged; the receiver stops waiting below it
+    AckHeader ack;       // Piggybacked acknowledgement of the peer's messages
     uint32_t id_len;
     uint32_t conversation_id_len;
     uint32_t sender_id_len;
@@ -21,13 +38,48 @@ struct MessageFrame {
     uint64_t timestamp;
     uint32_t content_size;
     uint8_t status;
-    // Followed by variable-length strings and content
+    // Followed by variable-length strings, content and the ack ranges
 };
 
+// Standalone acknowledgement, sent when there is no message to carry it
 struct AckFrame {
-    uint32_t magic; // 'MACK'
-    uint32_t message_id_len;
-    // Followed by message_id
+    uint32_t magic; // 'SACK'
+    AckHeader ack;
+    // Followed by the ack ranges
+};
+
+// Several messages to one receiver under a single encryption
+struct BatchFrame {
+    uint32_t magic;         // 'MBAT'
+    uint32_t crc32;         // Over everything after this field
+    uint32_t sender_id_len;
+    uint32_t count;
+    uint32_t content_size;
+    // Followed by sender_id and the encrypted content: each message frame,
+    // with its content in the clear, behind a 4-byte length
+};
+
+// Opens a messaging session with a peer. Each side states the highest frame
+// version it speaks and both use the lower; a hello that isn't a reply is
+// answered with one that is.
+struct HelloFrame {
+    uint32_t magic;  // 'MHEL'
+    uint8_t version; // Highest message frame version the sender speaks
+    uint8_t flags;   // HELLO_REPLY
+    uint32_t epoch;  // The sender's, so a restarted peer is noticed
+};
+
+// Version 2 message frame, for peers that have agreed to it. After this
+// prefix come LEB128 varints: sequence, sequence - floor, timestamp, then
+// (if HAS_ACK) the 4-byte ack epoch, cumulative and ranges as deltas. Then
+// the message id, conversation, sender and receiver ids, and the content
+// behind its length. UUID ids go as 16 bytes, and the other three ids as a
+// per-peer handle once the peer has acknowledged a frame that defined it.
+struct CompactFrame {
+    uint32_t magic; // 'MSG2'
+    uint32_t crc32; // Over everything after this field
+    uint32_t epoch;
+    uint8_t flags;  // Status, ack range count and HAS_ACK
 };
 #pragma pack(pop)
 
@@ -43,6 +95,42 @@ struct PendingMessage {
     std::string receiver_id;
     int retry_count;
     std::chrono::steady_clock::time_point next_retry;
+    std::chrono::steady_clock::time_point sent_at; // First transmission, for RTT samples
+    uint32_t sequence;
+    std::string sender_id;
+    bool batched; // data is a frame with content in the clear, sent inside a batch
+    // A compact frame is laid out again for each retry, since the receiver may
+    // have lost the names it used; data is then empty and these are kept instead
+    bool compact;
+    std::string conversation_id;
+    std::vector<uint8_t> content; // As the frame carries it
+    uint8_t status;
+};
+
+struct SequenceAck {
+    uint32_t epoch = 0;
+    uint32_t cumulative = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // Inclusive, above cumulative
+};
+
+struct MessageSequencing {
+    uint32_t epoch = 0;
+    uint32_t sequence = 0;
+    uint32_t floor = 0;
+    SequenceAck ack;
+};
+
+// A received message as views into its frame, valid while that is. content
+// is still encrypted unless the frame came in a batch.
+struct MessageView {
+    std::string_view id;
+    std::string_view conversation_id;
+    std::string_view sender_id;
+    std::string_view receiver_id;
+    std::span<const uint8_t> content;
+    uint8_t status;
+    uint64_t timestamp;
+    MessageSequencing sequencing;
 };
 
 class Crypto;
@@ -58,6 +146,13 @@ public:
 
     void set_message_callback(MessageCallback callback);
     void set_bluetooth_sender(std::function<bool(const std::string& device_id, const std::vector<uint8_t>& data)> sender);
+    // Reports the round trip of each message ACKed on its first transmission;
+    // retransmitted ones are skipped since their ACK is ambiguous
+    void set_rtt_callback(std::function<void(const std::string& device_id, std::chrono::microseconds rtt)> callback);
+    // Opt-in Nagle-style batching: messages to one receiver within max_delay
+    // of the first go out together in one encrypted frame. 0, the default,
+    // sends each on its own; keep it well inside the 100ms latency budget.
+    void set_batch_delay(std::chrono::milliseconds max_delay);
 
     bool send_message(const std::string& id, const std::string& conversation_id,
                       const std::string& sender_id, const std::string& receiver_id,
@@ -65,19 +160,35 @@ public:
 
     void receive_data(const std::string& sender_id, const std::vector<uint8_t>& data);
 
+    // Version 1 frames, which every peer with sequenced ACKs understands
     std::vector<uint8_t> pack_message(const std::string& id, const std::string& conversation_id,
                                       const std::string& sender_id, const std::string& receiver_id,
-                                      const std::vector<uint8_t>& content, uint8_t status);
+                                      const std::vector<uint8_t>& content, uint8_t status,
+                                      const MessageSequencing& sequencing);
     bool unpack_message(const std::vector<uint8_t>& data, std::string& id, std::string& conversation_id,
                         std::string& sender_id, std::string& receiver_id,
-                        std::vector<uint8_t>& content, uint8_t& status, uint64_t& timestamp);
+                        std::vector<uint8_t>& content, uint8_t& status, uint64_t& timestamp,
+                        MessageSequencing& sequencing);
+    // Appends the frame to out, encrypting content straight into it; out may
+    // be reused across messages. False, with out unchanged, if encryption fails.
+    bool pack_message(const std::string& id, const std::string& conversation_id,
+                      const std::string& sender_id, const std::string& receiver_id,
+                      std::span<const uint8_t> content, uint8_t status,
+                      const MessageSequencing& sequencing, std::vector<uint8_t>& out);
+    // Checks the frame and points message at its parts without copying them
+    bool unpack_message(std::span<const uint8_t> data, MessageView& message);
 
-    std::vector<uint8_t> pack_ack(const std::string& message_id);
-    bool unpack_ack(const std::vector<uint8_t>& data, std::string& message_id);
+    std::vector<uint8_t> pack_ack(const SequenceAck& ack);
+    bool unpack_ack(const std::vector<uint8_t>& data, SequenceAck& ack);
 
 private:
-    static constexpr uint32_t MAGIC = 0x4D41434B; // 'MACK'
+    static constexpr uint32_t MAGIC = 0x5341434B; // 'SACK'
+    static constexpr uint32_t BATCH_MAGIC = 0x4D424154; // 'MBAT'
+    static constexpr uint32_t HELLO_MAGIC = 0x4D48454C; // 'MHEL'
+    static constexpr uint32_t COMPACT_MAGIC = 0x4D534732; // 'MSG2'
+    static constexpr uint8_t FRAME_VERSION = 2; // Version 1 is MessageFrame, spoken before any hello
     static constexpr size_t MAX_MESSAGE_SIZE = 65536;
+    static constexpr size_t MAX_ACK_RANGES = 4;
 
     class Impl;
     std::unique_ptr<Impl> pimpl;
@@ -4,6 +4,9 @@
 #include <map>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 
 #if defined(__APPLE__)
 #include <CoreFoundation/CoreFoundation.h>
@@ -23,6 +26,30 @@ namespace fs = std::filesystem;
 extern "C" int crypto_encrypt(const uint8_t* data, size_t len, uint8_t* out);
 extern "C" int crypto_decrypt(const uint8_t* data, size_t len, uint8_t* out);
 
+// Global "bandwidth_limit" and per-peer "bandwidth_limit.<id>" keys, in KB/s
+static bool is_bandwidth_key(const std::string& key) {
+    return key == "bandwidth_limit" || key.rfind("bandwidth_limit.", 0) == 0;
+}
+
+#if defined(__linux__)
+// Picks the bandwidth limits out of the saved JSON-like string
+static void parse_bandwidth_limits(const std::string& data, std::map<std::string, int>& limits) {
+    size_t pos = 0;
+    while ((pos = data.find("\"bandwidth_limit", pos)) != std::string::npos) {
+        size_t key_end = data.find('"', pos + 1);
+        if (key_end == std::string::npos || key_end + 1 >= data.size() || data[key_end + 1] != ':') break;
+        std::string key = data.substr(pos + 1, key_end - pos - 1);
+        const char* value = data.c_str() + key_end + 2;
+        char* value_end;
+        long kbps = std::strtol(value, &value_end, 10);
+        if (value_end != value && kbps >= 0 && kbps <= INT_MAX && is_bandwidth_key(key)) {
+            limits[key] = static_cast<int>(kbps);
+        }
+        pos = key_end + 1;
+    }
+}
+#endif
+
 class Settings::Impl {
 public:
     std::map<std::string, std::string> string_settings;
@@ -54,6 +81,14 @@ public:
         CFPreferencesSetAppValue(CFSTR("profile_picture_path"), CFStringCreateWithCString(NULL, string_settings["profile_picture_path"].c_str(), kCFStringEncodingUTF8), appID);
         CFPreferencesSetAppValue(CFSTR("email"), CFStringCreateWithCString(NULL, string_settings["email"].c_str(), kCFStringEncodingUTF8), appID);
         CFPreferencesSetAppValue(CFSTR("first_run"), bool_settings["first_run"] ? kCFBooleanTrue : kCFBooleanFalse, appID);
+        for (auto& [key, limit] : int_settings) {
+            if (!is_bandwidth_key(key)) continue;
+            CFStringRef name = CFStringCreateWithCString(NULL, key.c_str(), kCFStringEncodingUTF8);
+            CFNumberRef number = CFNumberCreate(NULL, kCFNumberIntType, &limit);
+            CFPreferencesSetAppValue(name, number, appID);
+            CFRelease(number);
+            CFRelease(name);
+        }
         CFPreferencesAppSynchronize(appID);
         // Save trusted devices to Keychain
         for (size_t i = 0; i < trusted_devices.size(); ++i) {
@@ -88,6 +123,10 @@ public:
         RegSetValueEx(hKey, "email", 0, REG_SZ, (BYTE*)string_settings["email"].c_str(), string_settings["email"].size() + 1);
         DWORD first = bool_settings["first_run"] ? 1 : 0;
         RegSetValueEx(hKey, "first_run", 0, REG_DWORD, (BYTE*)&first, sizeof(DWORD));
+        for (auto& [key, limit] : int_settings) {
+            if (!is_bandwidth_key(key)) continue;
+            RegSetValueEx(hKey, key.c_str(), 0, REG_DWORD, (BYTE*)&limit, sizeof(DWORD));
+        }
         RegCloseKey(hKey);
         // Save trusted devices encrypted
         std::string devices_str;
@@ -114,6 +153,10 @@ public:
         data += "\"profile_picture_path\":\"" + string_settings["profile_picture_path"] + "\",";
         data += "\"email\":\"" + string_settings["email"] + "\",";
         data += "\"first_run\":" + (bool_settings["first_run"] ? "true" : "false") + ",";
+        for (const auto& [key, limit] : int_settings) {
+            if (!is_bandwidth_key(key)) continue;
+            data += "\"" + key + "\":" + std::to_string(limit) + ",";
+        }
         data += "\"trusted_devices\":[";
         for (size_t i = 0; i < trusted_devices.size(); ++i) {
             data += "\"" + trusted_devices[i] + "\"";
@@ -193,6 +236,32 @@ public:
         bool_val = (CFBooleanRef)CFPreferencesCopyAppValue(CFSTR("first_run"), appID);
         bool_settings["first_run"] = bool_val ? CFBooleanGetValue(bool_val) : true; // Default
         if (bool_val) CFRelease(bool_val);
+        num = (CFNumberRef)CFPreferencesCopyAppValue(CFSTR("bandwidth_limit"), appID);
+        if (num) {
+            int val;
+            CFNumberGetValue(num, kCFNumberIntType, &val);
+            int_settings["bandwidth_limit"] = std::max(val, 0);
+            CFRelease(num);
+        } else {
+            int_settings["bandwidth_limit"] = 0; // Default: unlimited
+        }
+        CFArrayRef keys = CFPreferencesCopyKeyList(appID, kCFPreferencesCurrentUser, kCFPreferencesAnyHost);
+        if (keys) {
+            for (CFIndex i = 0; i < CFArrayGetCount(keys); ++i) {
+                CFStringRef key = (CFStringRef)CFArrayGetValueAtIndex(keys, i);
+                char buffer[256];
+                if (!CFStringGetCString(key, buffer, sizeof(buffer), kCFStringEncodingUTF8)) continue;
+                std::string name = buffer;
+                if (name == "bandwidth_limit" || !is_bandwidth_key(name)) continue;
+                num = (CFNumberRef)CFPreferencesCopyAppValue(key, appID);
+                if (num) {
+                    int val;
+                    if (CFNumberGetValue(num, kCFNumberIntType, &val) && val >= 0) int_settings[name] = val;
+                    CFRelease(num);
+                }
+            }
+            CFRelease(keys);
+        }
         // Load trusted devices from Keychain
 #elif defined(_WIN32)
         HKEY hKey;
@@ -235,6 +304,23 @@ public:
             DWORD first;
             RegQueryValueEx(hKey, "first_run", NULL, NULL, (BYTE*)&first, &size);
             bool_settings["first_run"] = first != 0;
+            DWORD bandwidth = 0;
+            size = sizeof(bandwidth);
+            RegQueryValueEx(hKey, "bandwidth_limit", NULL, NULL, (BYTE*)&bandwidth, &size);
+            int_settings["bandwidth_limit"] = std::max(static_cast<int>(bandwidth), 0);
+            char name[256];
+            for (DWORD index = 0; ; ++index) {
+                DWORD name_size = sizeof(name);
+                DWORD type = 0;
+                DWORD limit = 0;
+                size = sizeof(limit);
+                LONG result = RegEnumValue(hKey, index, name, &name_size, NULL, &type, (BYTE*)&limit, &size);
+                if (result == ERROR_NO_MORE_ITEMS) break;
+                if (result != ERROR_SUCCESS || type != REG_DWORD) continue; // Larger values such as trusted_devices
+                if (std::string(name) != "bandwidth_limit" && is_bandwidth_key(name) && static_cast<int>(limit) >= 0) {
+                    int_settings[name] = static_cast<int>(limit);
+                }
+            }
             RegCloseKey(hKey);
         } else {
             // Defaults
@@ -245,6 +331,7 @@ public:
             bool_settings["notifications_enabled"] = true;
             bool_settings["auto_update_enabled"] = true;
             bool_settings["first_run"] = true;
+            int_settings["bandwidth_limit"] = 0;
         }
 #elif defined(__linux__)
         std::string config_dir = g_get_user_config_dir();
@@ -257,6 +344,7 @@ public:
             int dec_len = crypto_decrypt(encrypted.data(), encrypted.size(), decrypted.data());
             if (dec_len > 0) {
                 std::string data((char*)decrypted.data(), dec_len);
+                parse_bandwidth_limits(data, int_settings);
                 // Parse JSON-like string (simple parsing)
                 // For simplicity, assume it's JSON and use a library, but since no JSON lib, skip parsing for now
                 // In real app, use nlohmann/json or similar
@@ -272,6 +360,7 @@ public:
             bool_settings["notifications_enabled"] = true;
             bool_settings["auto_update_enabled"] = true;
             bool_settings["first_run"] = true;
+            int_settings.emplace("bandwidth_limit", 0); // Kept if parsed above
         }
 #endif
     }
@@ -298,6 +387,20 @@ bool Settings::get_notifications_enabled() { return pimpl->bool_settings["notifi
 void Settings::set_auto_update_enabled(bool enabled) { pimpl->bool_settings["auto_update_enabled"] = enabled; }
 bool Settings::get_auto_update_enabled() { return pimpl->bool_settings["auto_update_enabled"]; }
 
+// Negative limits are rejected; they would wrap when widened to bytes per second
+void Settings::set_bandwidth_limit(int kbps) {
+    if (kbps >= 0) pimpl->int_settings["bandwidth_limit"] = kbps;
+}
+int Settings::get_bandwidth_limit() { return pimpl->int_settings["bandwidth_limit"]; }
+
+void Settings::set_peer_bandwidth_limit(const std::string& device_id, int kbps) {
+    if (kbps >= 0) pimpl->int_settings["bandwidth_limit." + device_id] = kbps;
+}
+int Settings::get_peer_bandwidth_limit(const std::string& device_id) {
+    auto it = pimpl->int_settings.find("bandwidth_limit." + device_id);
+    return it != pimpl->int_settings.end() ? it->second : 0;
+}
+
 void Settings::set_profile_picture_path(const std::string& path) { pimpl->string_settings["profile_picture_path"] = path; }
 std::string Settings::get_profile_picture_path() { return pimpl->string_settings["profile_picture_path"]; }
 
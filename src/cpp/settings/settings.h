@@ -47,6 +47,13 @@ public:
     void set_auto_update_enabled(bool enabled);
     bool get_auto_update_enabled();
 
+    // File transfer bandwidth in KB/s, 0 for unlimited
+    void set_bandwidth_limit(int kbps);
+    int get_bandwidth_limit();
+
+    void set_peer_bandwidth_limit(const std::string& device_id, int kbps);
+    int get_peer_bandwidth_limit(const std::string& device_id);
+
     // User settings
     void set_profile_picture_path(const std::string& path);
     std::string get_profile_picture_path();
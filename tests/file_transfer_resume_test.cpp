@@ -0,0 +1,332 @@
+// Interrupts a file transfer partway through, restarts both ends and sends the
+// file again, checking that only the missing chunks cross the link the second time.
+// Also resumes after the final chunk was acknowledged with an earlier one still
+// missing, and sends one file twice, as a finished transfer must not block a new one.
+#include "file_transfer/file_transfer.h"
+#include "crypto/crypto.h"
+#include "database/database.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <thread>
+
+// Pass-through Crypto so the test runs without the Rust crypto library
+class Crypto::Impl {};
+Crypto::Crypto() = default;
+Crypto::~Crypto() = default;
+std::array<uint8_t, 32> Crypto::get_ecdh_public_key() { return {}; }
+std::string Crypto::get_rsa_public_key_pem() { return ""; }
+std::array<uint8_t, 32> Crypto::derive_shared_secret(const std::array<uint8_t, 32>&) { return {}; }
+void Crypto::set_session_key(const std::string&, const std::array<uint8_t, 32>&) {}
+std::vector<uint8_t> Crypto::encrypt_message(const std::string&, const std::vector<uint8_t>& data) { return data; }
+bool Crypto::encrypt_message(const std::string&, const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+    out.insert(out.end(), data, data + len);
+    return true;
+}
+std::vector<uint8_t> Crypto::decrypt_message(const std::string&, const std::vector<uint8_t>& data) { return data; }
+bool Crypto::decrypt_message(const std::string&, const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+    out.insert(out.end(), data, data + len);
+    return true;
+}
+std::string Crypto::calculate_checksum(const std::vector<uint8_t>&) { return ""; }
+void Crypto::store_secure_key(const std::string&, const std::vector<uint8_t>&) {}
+std::vector<uint8_t> Crypto::retrieve_secure_key(const std::string&) { return {}; }
+
+static constexpr uint64_t CHUNK = 61440; // FileTransfer's SEND_CHUNK_SIZE
+static constexpr uint64_t CHUNK_COUNT = 48;
+static constexpr uint64_t FILE_SIZE = CHUNK * (CHUNK_COUNT - 1) + 1234;
+static constexpr uint64_t CUT_AFTER_CHUNKS = 20;
+static constexpr uint64_t WINDOW = 8; // FileTransfer's WINDOW_CHUNKS, which may go out before the receiver's first SACK
+
+static constexpr uint64_t NO_LOST_CHUNK = UINT64_MAX;
+
+// Carries packets between a sender and a receiver on one thread, so neither side
+// re-enters the other while holding its locks. Counts the file chunks it delivers
+// and, once cut_after have arrived, delivers nothing more to the receiver; SACKs
+// already on their way still reach the sender. A lost chunk is never delivered.
+// Declared before the transfers it joins, and stopped before they are destroyed.
+class Link {
+public:
+    explicit Link(uint64_t cut_after, uint64_t lost_chunk = NO_LOST_CHUNK) : cut_after(cut_after), lost_chunk(lost_chunk) {}
+    ~Link() { stop(); }
+
+    void attach(FileTransfer& sender_end, FileTransfer& receiver_end) {
+        sender = &sender_end;
+        receiver = &receiver_end;
+        sender->set_data_sender([this](const std::string&, const std::vector<uint8_t>& data) {
+            return post(true, data);
+        });
+        receiver->set_data_sender([this](const std::string&, const std::vector<uint8_t>& data) {
+            return post(false, data);
+        });
+        pump = std::thread([this] { run(); });
+    }
+
+    // Later packets are refused, as by a link that has gone away
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (pump.joinable()) pump.join();
+    }
+
+    // Waits for the cut and for every packet then heading to the sender to arrive
+    bool wait_for_cut(std::chrono::seconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, timeout, [this] {
+            return cut && !delivering && std::none_of(queue.begin(), queue.end(), [](const auto& packet) { return !packet.first; });
+        });
+    }
+
+    uint64_t chunks_delivered() const { return chunks; }
+
+private:
+    bool post(bool to_receiver, const std::vector<uint8_t>& data) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return false;
+            queue.emplace_back(to_receiver, data);
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    // Chunk PUTs carry CHUNK_OFFSET right after the connection id; the opening PUT
+    // has its transfer id there
+    static bool chunk_index(const std::vector<uint8_t>& data, uint64_t& index) {
+        size_t after_connection = sizeof(OBEXHeader) + 5;
+        if (data.size() < after_connection + 5 || data[0] != static_cast<uint8_t>(OBEXOpcode::PUT) ||
+            data[after_connection] != static_cast<uint8_t>(OBEXHeaderId::CHUNK_OFFSET)) {
+            return false;
+        }
+        const uint8_t* offset = data.data() + after_connection + 1;
+        index = ((uint64_t(offset[0]) << 24) | (uint64_t(offset[1]) << 16) | (uint64_t(offset[2]) << 8) | offset[3]) / CHUNK;
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            auto [to_receiver, data] = std::move(queue.front());
+            queue.pop_front();
+            uint64_t index;
+            bool is_chunk = to_receiver && chunk_index(data, index);
+            if (to_receiver && cut) continue;
+            if (is_chunk && index == lost_chunk) continue;
+            delivering = true;
+            lock.unlock();
+            if (to_receiver) {
+                receiver->receive_packet("sender", data);
+            } else {
+                sender->receive_packet("receiver", data);
+            }
+            lock.lock();
+            delivering = false;
+            if (is_chunk && ++chunks == cut_after) cut = true;
+            cv.notify_all();
+        }
+    }
+
+    FileTransfer* sender = nullptr;
+    FileTransfer* receiver = nullptr;
+    uint64_t cut_after;
+    uint64_t lost_chunk;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<bool, std::vector<uint8_t>>> queue;
+    std::atomic<uint64_t> chunks{0};
+    bool cut = false;
+    bool delivering = false;
+    bool stopping = false;
+    std::thread pump;
+};
+
+static bool fail(const std::string& what) {
+    std::cerr << "FAIL: " << what << std::endl;
+    return false;
+}
+
+static void accept_into(FileTransfer& receiver, const std::string& save_path) {
+    receiver.set_incoming_file_callback([save_path](const std::string&, uint64_t, std::function<void(bool, const std::string&)> response) {
+        response(true, save_path);
+    });
+}
+
+static std::vector<char> read_file(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void write_source(const std::filesystem::path& source, const std::vector<char>& contents) {
+    std::filesystem::remove(source);
+    std::ofstream(source, std::ios::binary).write(contents.data(), contents.size());
+}
+
+// Sends source to the receiver and waits for the sender's completion callback
+static bool send_and_wait(FileTransfer& sender, const std::filesystem::path& source, const std::string& attempt) {
+    auto finished = std::make_shared<std::promise<std::pair<bool, std::string>>>();
+    bool started = sender.send_file(source.string(), "receiver", nullptr, [finished](bool success, const std::string& error) {
+        finished->set_value({success, error});
+    });
+    if (!started) return fail(attempt + ": send_file refused");
+    auto result = finished->get_future();
+    if (result.wait_for(std::chrono::seconds(30)) != std::future_status::ready) return fail(attempt + ": transfer did not finish");
+    auto [success, error] = result.get();
+    if (!success) return fail(attempt + ": transfer failed: " + error);
+    return true;
+}
+
+static bool test_resume(const std::vector<char>& contents) {
+    std::filesystem::path source = std::filesystem::absolute("resume_source.bin");
+    std::filesystem::path target = std::filesystem::absolute("resume_target.bin");
+    std::filesystem::remove(target);
+    std::filesystem::remove("bluebeam.db");
+    write_source(source, contents);
+
+    Crypto crypto;
+
+    // First attempt: the link goes down partway, then both ends shut down
+    {
+        Database database;
+        Link link(CUT_AFTER_CHUNKS);
+        FileTransfer sender(crypto, database);
+        FileTransfer receiver(crypto, database);
+        accept_into(receiver, target.string());
+        link.attach(sender, receiver);
+        bool started = sender.send_file(source.string(), "receiver");
+        bool cut = started && link.wait_for_cut(std::chrono::seconds(10));
+        link.stop();
+        if (!started) return fail("first send_file refused");
+        if (!cut) return fail("first attempt never reached the cut");
+    }
+
+    // Second attempt: fresh instances send the same file to the same peer
+    Database database;
+    Link link(CHUNK_COUNT * 2);
+    FileTransfer sender(crypto, database);
+    FileTransfer receiver(crypto, database);
+    accept_into(receiver, target.string());
+    link.attach(sender, receiver);
+    bool sent = send_and_wait(sender, source, "resumed send");
+    link.stop();
+    if (!sent) return false;
+
+    // The receiver closes the file once the last chunk lands, before the final SACK goes out
+    if (read_file(target) != contents) return fail("received file differs from the source");
+    uint64_t resent = link.chunks_delivered();
+    if (resent > CHUNK_COUNT - CUT_AFTER_CHUNKS + WINDOW) {
+        return fail("resume resent " + std::to_string(resent) + " of " + std::to_string(CHUNK_COUNT) + " chunks");
+    }
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(target);
+    return true;
+}
+
+// The final chunk carries the digest and Merkle root, so it has to go out again
+// even when the first attempt already had it acknowledged
+static bool test_resume_after_final_chunk(const std::vector<char>& contents) {
+    std::filesystem::path source = std::filesystem::absolute("final_source.bin");
+    std::filesystem::path target = std::filesystem::absolute("final_target.bin");
+    std::filesystem::remove(target);
+    std::filesystem::remove("bluebeam.db");
+    write_source(source, contents);
+
+    Crypto crypto;
+
+    // First attempt: one chunk near the end is lost, every other one is acknowledged
+    {
+        Database database;
+        Link link(CHUNK_COUNT - 1, CHUNK_COUNT - 2);
+        FileTransfer sender(crypto, database);
+        FileTransfer receiver(crypto, database);
+        accept_into(receiver, target.string());
+        link.attach(sender, receiver);
+        bool started = sender.send_file(source.string(), "receiver");
+        bool cut = started && link.wait_for_cut(std::chrono::seconds(10));
+        link.stop();
+        if (!started) return fail("final chunk case: first send_file refused");
+        if (!cut) return fail("final chunk case: first attempt never reached the cut");
+    }
+
+    Database database;
+    Link link(CHUNK_COUNT * 2);
+    FileTransfer sender(crypto, database);
+    FileTransfer receiver(crypto, database);
+    accept_into(receiver, target.string());
+    std::promise<std::pair<bool, std::string>> verified;
+    receiver.set_received_file_callback([&verified](const std::string&, bool success, const std::string& error) {
+        verified.set_value({success, error});
+    });
+    auto received = verified.get_future();
+    link.attach(sender, receiver);
+    bool sent = send_and_wait(sender, source, "final chunk case: resumed send");
+    bool done = sent && received.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+    link.stop();
+    if (!sent) return false;
+    if (!done) return fail("final chunk case: receiver never finished");
+    auto [success, error] = received.get();
+    if (!success) return fail("final chunk case: receiver failed: " + error);
+    if (read_file(target) != contents) return fail("final chunk case: received file differs from the source");
+
+    bool checksum_saved = false;
+    for (const auto& file : database.get_files()) {
+        if (file.receiver_id == "receiver" && !file.checksum.empty()) checksum_saved = true;
+    }
+    if (!checksum_saved) return fail("final chunk case: sender never saved the file checksum");
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(target);
+    return true;
+}
+
+static bool test_send_twice(const std::vector<char>& contents) {
+    std::filesystem::path source = std::filesystem::absolute("twice_source.bin");
+    std::filesystem::path target = std::filesystem::absolute("twice_target.bin");
+    std::filesystem::remove(target);
+    std::filesystem::remove("bluebeam.db");
+    write_source(source, contents);
+
+    Crypto crypto;
+    Database database;
+    Link link(CHUNK_COUNT * 4);
+    FileTransfer sender(crypto, database);
+    FileTransfer receiver(crypto, database);
+    accept_into(receiver, target.string());
+    link.attach(sender, receiver);
+    bool sent = send_and_wait(sender, source, "first send") && send_and_wait(sender, source, "second send");
+    link.stop();
+    if (!sent) return false;
+    if (read_file(target) != contents) return fail("file sent twice differs from the source");
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(target);
+    return true;
+}
+
+int main() {
+    std::vector<char> contents(FILE_SIZE);
+    std::mt19937 random(42);
+    for (auto& byte : contents) byte = static_cast<char>(random());
+
+    if (!test_resume(contents) || !test_resume_after_final_chunk(contents) || !test_send_twice(contents)) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "file transfer resume: ok" << std::endl;
+    return EXIT_SUCCESS;
+}